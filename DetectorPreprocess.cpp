@@ -0,0 +1,241 @@
+
+#include "DetectorPreprocess.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include <opencv2/core/utility.hpp>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DETECTOR_PREPROCESS_NEON 1
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define DETECTOR_PREPROCESS_SSE41 1
+#endif
+
+namespace {
+
+// ITU-R BT.601 (limited range) の固定小数点係数。OpenCV の YUV422 -> BGR 変換と同じ値
+constexpr int sk_Shift = 20;
+constexpr int sk_Round = 1 << (sk_Shift - 1);
+constexpr int sk_CY    = 1220542;
+constexpr int sk_CUB   = 2116026;
+constexpr int sk_CUG   = -409993;
+constexpr int sk_CVG   = -852492;
+constexpr int sk_CVR   = 1673527;
+
+inline uint8_t Saturate( int value )
+{
+    return static_cast<uint8_t>( value < 0 ? 0 : (value > 255 ? 255 : value) );
+}
+
+inline void YuvToBgr( int y, int u, int v, uint8_t* bgr )
+{
+    const int yy = std::max( 0, y - 16 ) * sk_CY;
+    u -= 128;
+    v -= 128;
+    bgr[0] = Saturate( (yy + (sk_Round + sk_CUB * u)) >> sk_Shift );
+    bgr[1] = Saturate( (yy + (sk_Round + sk_CVG * v + sk_CUG * u)) >> sk_Shift );
+    bgr[2] = Saturate( (yy + (sk_Round + sk_CVR * v)) >> sk_Shift );
+}
+
+// cv::resize(INTER_NEAREST) と同じ丸め方で、出力座標 -> 入力座標の表を作る
+void BuildNearestOffsets( int src_length, int dst_length, std::vector<int>& offsets )
+{
+    const double scale = 1.0 / (static_cast<double>(dst_length) / src_length);
+
+    offsets.resize( dst_length );
+    for( int i = 0; i < dst_length; ++i ){
+        offsets[i] = std::min( cvFloor( i * scale ), src_length - 1 );
+    }
+}
+
+void ResizeRowBGR( const uint8_t* src, const int* x_offsets, int width, uint8_t* dst )
+{
+    // 3 バイト単位の gather なので SIMD にはせず、オフセット表を引くだけにする
+    for( int x = 0; x < width; ++x ){
+        const uint8_t* p = src + x_offsets[x] * 3;
+        dst[x * 3 + 0] = p[0];
+        dst[x * 3 + 1] = p[1];
+        dst[x * 3 + 2] = p[2];
+    }
+}
+
+void ConvertRowYUYVReference( const uint8_t* src, const int* x_offsets, int width, uint8_t* dst )
+{
+    for( int x = 0; x < width; ++x ){
+        const int sx   = x_offsets[x];
+        const int pair = sx & ~1;
+        YuvToBgr( src[sx * 2], src[pair * 2 + 1], src[pair * 2 + 3], dst + x * 3 );
+    }
+}
+
+// y/u/v は 1 行分の作業領域 (width 要素)。L1 に乗る大きさなので、入力画像を読むのは 1 回だけ
+void ConvertRowYUYV( const uint8_t* src, const int* x_offsets, int width, uint8_t* dst,
+                     int32_t* y, int32_t* u, int32_t* v )
+{
+    int x = 0;
+
+#if defined(DETECTOR_PREPROCESS_NEON) || defined(DETECTOR_PREPROCESS_SSE41)
+    const int simd_width = width & ~7;
+    for( int i = 0; i < simd_width; ++i ){
+        const int sx   = x_offsets[i];
+        const int pair = sx & ~1;
+        y[i] = src[sx * 2] - 16;
+        u[i] = src[pair * 2 + 1] - 128;
+        v[i] = src[pair * 2 + 3] - 128;
+    }
+#endif
+
+#if defined(DETECTOR_PREPROCESS_NEON)
+    const int32x4_t zero  = vdupq_n_s32( 0 );
+    const int32x4_t round = vdupq_n_s32( sk_Round );
+    for( ; x < simd_width; x += 8 ){
+        int32x4_t b[2], g[2], r[2];
+        for( int h = 0; h < 2; ++h ){
+            const int32x4_t yy = vmulq_n_s32( vmaxq_s32( vld1q_s32( y + x + h * 4 ), zero ), sk_CY );
+            const int32x4_t uu = vld1q_s32( u + x + h * 4 );
+            const int32x4_t vv = vld1q_s32( v + x + h * 4 );
+            b[h] = vshrq_n_s32( vaddq_s32( yy, vmlaq_n_s32( round, uu, sk_CUB ) ), sk_Shift );
+            g[h] = vshrq_n_s32( vaddq_s32( yy, vmlaq_n_s32( vmlaq_n_s32( round, vv, sk_CVG ), uu, sk_CUG ) ), sk_Shift );
+            r[h] = vshrq_n_s32( vaddq_s32( yy, vmlaq_n_s32( round, vv, sk_CVR ) ), sk_Shift );
+        }
+        uint8x8x3_t bgr;
+        bgr.val[0] = vqmovn_u16( vcombine_u16( vqmovun_s32( b[0] ), vqmovun_s32( b[1] ) ) );
+        bgr.val[1] = vqmovn_u16( vcombine_u16( vqmovun_s32( g[0] ), vqmovun_s32( g[1] ) ) );
+        bgr.val[2] = vqmovn_u16( vcombine_u16( vqmovun_s32( r[0] ), vqmovun_s32( r[1] ) ) );
+        vst3_u8( dst + x * 3, bgr );
+    }
+#elif defined(DETECTOR_PREPROCESS_SSE41)
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32( sk_Round );
+    const __m128i cy    = _mm_set1_epi32( sk_CY );
+    const __m128i cub   = _mm_set1_epi32( sk_CUB );
+    const __m128i cug   = _mm_set1_epi32( sk_CUG );
+    const __m128i cvg   = _mm_set1_epi32( sk_CVG );
+    const __m128i cvr   = _mm_set1_epi32( sk_CVR );
+    for( ; x < simd_width; x += 8 ){
+        __m128i b[2], g[2], r[2];
+        for( int h = 0; h < 2; ++h ){
+            const __m128i yy = _mm_mullo_epi32( _mm_max_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i*>(y + x + h * 4) ), zero ), cy );
+            const __m128i uu = _mm_loadu_si128( reinterpret_cast<const __m128i*>(u + x + h * 4) );
+            const __m128i vv = _mm_loadu_si128( reinterpret_cast<const __m128i*>(v + x + h * 4) );
+            b[h] = _mm_srai_epi32( _mm_add_epi32( yy, _mm_add_epi32( round, _mm_mullo_epi32( uu, cub ) ) ), sk_Shift );
+            g[h] = _mm_srai_epi32( _mm_add_epi32( yy, _mm_add_epi32( _mm_add_epi32( round, _mm_mullo_epi32( vv, cvg ) ), _mm_mullo_epi32( uu, cug ) ) ), sk_Shift );
+            r[h] = _mm_srai_epi32( _mm_add_epi32( yy, _mm_add_epi32( round, _mm_mullo_epi32( vv, cvr ) ) ), sk_Shift );
+        }
+        alignas(16) uint8_t bb[16], gg[16], rr[16];
+        _mm_store_si128( reinterpret_cast<__m128i*>(bb), _mm_packus_epi16( _mm_packs_epi32( b[0], b[1] ), zero ) );
+        _mm_store_si128( reinterpret_cast<__m128i*>(gg), _mm_packus_epi16( _mm_packs_epi32( g[0], g[1] ), zero ) );
+        _mm_store_si128( reinterpret_cast<__m128i*>(rr), _mm_packus_epi16( _mm_packs_epi32( r[0], r[1] ), zero ) );
+        uint8_t* p = dst + x * 3;
+        for( int i = 0; i < 8; ++i ){
+            p[i * 3 + 0] = bb[i];
+            p[i * 3 + 1] = gg[i];
+            p[i * 3 + 2] = rr[i];
+        }
+    }
+#else
+    (void)y;
+    (void)u;
+    (void)v;
+#endif
+
+    // 端数はスカラーで処理する
+    ConvertRowYUYVReference( src, x_offsets + x, width - x, dst + x * 3 );
+}
+
+void CheckArguments( const cv::Mat& src, DetectorInputFormat format, cv::Size size )
+{
+    if( src.empty() || size.width <= 0 || size.height <= 0 ){
+        CV_Error( cv::Error::StsBadArg, "DetectorPreprocess: empty input or output size." );
+    }
+    if( format == DETECTOR_INPUT_BGR && src.type() != CV_8UC3 ){
+        CV_Error( cv::Error::StsBadArg, "DetectorPreprocess: BGR input must be CV_8UC3." );
+    }
+    if( format == DETECTOR_INPUT_YUYV && (src.type() != CV_8UC2 || (src.cols & 1) != 0) ){
+        CV_Error( cv::Error::StsBadArg, "DetectorPreprocess: YUYV input must be CV_8UC2 with even width." );
+    }
+}
+
+}
+
+DetectorPreprocessor::DetectorPreprocessor()
+    :
+      m_SourceSize(),
+      m_InputSize(),
+      m_StripeCount( 0 ),
+      m_XOffsets(),
+      m_YOffsets(),
+      m_Work()
+{}
+
+void DetectorPreprocessor::Prepare( cv::Size src_size, cv::Size dst_size )
+{
+    if( src_size == m_SourceSize && dst_size == m_InputSize ){
+        return;
+    }
+
+    BuildNearestOffsets( src_size.width, dst_size.width, m_XOffsets );
+    BuildNearestOffsets( src_size.height, dst_size.height, m_YOffsets );
+
+    // ストライプ数を固定し、作業領域をストライプごとに割り当てる
+    m_StripeCount = std::max( 1, std::min( cv::getNumThreads(), dst_size.height ) );
+    m_Work.resize( static_cast<size_t>(dst_size.width) * 3 * m_StripeCount );
+
+    m_SourceSize = src_size;
+    m_InputSize  = dst_size;
+}
+
+void DetectorPreprocessor::Build( const cv::Mat& src, DetectorInputFormat format, cv::Size size, cv::Mat& dst )
+{
+    CheckArguments( src, format, size );
+    Prepare( src.size(), size );
+    dst.create( size, CV_8UC3 );
+
+    const int stripe_count = m_StripeCount;
+    cv::parallel_for_( cv::Range( 0, stripe_count ), [&]( const cv::Range& range ){
+        for( int stripe = range.start; stripe < range.end; ++stripe ){
+            int32_t* work = m_Work.data() + static_cast<size_t>(size.width) * 3 * stripe;
+            const int row_begin = size.height * stripe / stripe_count;
+            const int row_end   = size.height * (stripe + 1) / stripe_count;
+
+            for( int row = row_begin; row < row_end; ++row ){
+                const uint8_t* src_row = src.ptr<uint8_t>( m_YOffsets[row] );
+                uint8_t* dst_row = dst.ptr<uint8_t>( row );
+
+                if( format == DETECTOR_INPUT_BGR ){
+                    ResizeRowBGR( src_row, m_XOffsets.data(), size.width, dst_row );
+                }
+                else {
+                    ConvertRowYUYV( src_row, m_XOffsets.data(), size.width, dst_row,
+                                    work, work + size.width, work + size.width * 2 );
+                }
+            }
+        }
+    }, stripe_count );
+}
+
+void BuildDetectorInputReference( const cv::Mat& src, DetectorInputFormat format, cv::Size size, cv::Mat& dst )
+{
+    CheckArguments( src, format, size );
+    dst.create( size, CV_8UC3 );
+
+    std::vector<int> x_offsets;
+    std::vector<int> y_offsets;
+    BuildNearestOffsets( src.cols, size.width, x_offsets );
+    BuildNearestOffsets( src.rows, size.height, y_offsets );
+
+    for( int row = 0; row < size.height; ++row ){
+        const uint8_t* src_row = src.ptr<uint8_t>( y_offsets[row] );
+        uint8_t* dst_row = dst.ptr<uint8_t>( row );
+
+        if( format == DETECTOR_INPUT_BGR ){
+            ResizeRowBGR( src_row, x_offsets.data(), size.width, dst_row );
+        }
+        else {
+            ConvertRowYUYVReference( src_row, x_offsets.data(), size.width, dst_row );
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef DETECTOR_PREPROCESS_HPP_INCLUDED
+#define DETECTOR_PREPROCESS_HPP_INCLUDED
+
+#include <cstdint>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// 顔検出器へ入力する画像の前処理
+//
+// キャプチャ画像 (BGR もしくは YUYV) から、検出器の入力サイズの BGR 画像を
+// 1 パスで生成する。最近傍リサイズと色変換を同じループで行い、出力先は使い回す。
+// 結果は cv::resize(INTER_NEAREST) (+ cv::cvtColor(COLOR_YUV2BGR_YUYV)) と同じになる。
+//
+// SIMD 化しているのは YUYV の色変換のみ。BGR 入力は画素の間引きだけなので cv::resize と同等の速さ。
+// 検出サイズがキャプチャサイズと同じ場合 (既定) は使われない。
+// YUYV カメラでも、配信・録画用の BGR 変換 (cv::cvtColor) はメインスレッドで従来どおり行う。
+// ここで省けるのは検出スレッド側の縮小前の全画素変換だけである。
+// 一致の確認は make test (preprocess_test.cpp)。NEON 版は ARM 上でビルドしたときだけ検証される。
+
+enum DetectorInputFormat
+{
+    DETECTOR_INPUT_BGR,     // CV_8UC3
+    DETECTOR_INPUT_YUYV     // CV_8UC2 (YUY2)
+};
+
+// SIMD (SSE4.1 / NEON) 版
+//
+// 座標のオフセット表と YUYV 変換の作業領域 (ストライプごと) を保持し、入出力サイズが
+// 変わらない限り使い回す。フレームごとのヒープ確保は無い。
+// Build() は同時に複数のスレッドから呼ばないこと (内部で cv::parallel_for_ を使う)。
+class DetectorPreprocessor
+{
+public:
+
+    DetectorPreprocessor();
+
+    // dst は size と型が同じなら再確保しない
+    void Build( const cv::Mat& src, DetectorInputFormat format, cv::Size size, cv::Mat& dst );
+
+private:
+
+    void Prepare( cv::Size src_size, cv::Size dst_size );
+
+    cv::Size             m_SourceSize;
+    cv::Size             m_InputSize;
+    int                  m_StripeCount;
+    std::vector<int>     m_XOffsets;
+    std::vector<int>     m_YOffsets;
+    std::vector<int32_t> m_Work;        // ストライプごとに 出力幅 x 3 (y, u, v)
+};
+
+// スカラー版。SIMD 版の検証・比較用
+void BuildDetectorInputReference( const cv::Mat& src, DetectorInputFormat format, cv::Size size, cv::Mat& dst );
+
+#endif  // DETECTOR_PREPROCESS_HPP_INCLUDED
@@ -0,0 +1,388 @@
+
+#include "FaceRecognition.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// FaceDetectorYN の検出結果の列
+constexpr int sk_FaceScoreColumn = 14;
+
+float IoU( const cv::Rect2f& a, const cv::Rect2f& b )
+{
+    const float x1 = std::max( a.x, b.x );
+    const float y1 = std::max( a.y, b.y );
+    const float x2 = std::min( a.x + a.width,  b.x + b.width );
+    const float y2 = std::min( a.y + a.height, b.y + b.height );
+    if( x2 <= x1 || y2 <= y1 ){
+        return 0.0f;
+    }
+
+    const float intersection = (x2 - x1) * (y2 - y1);
+    return intersection / (a.width * a.height + b.width * b.height - intersection);
+}
+
+cv::Rect2f FaceBox( const cv::Mat& faces, int row )
+{
+    const float* face = faces.ptr<float>(row);
+    return cv::Rect2f( face[0], face[1], face[2], face[3] );
+}
+
+// 顔の大きさと検出スコアが大きいほど、良い特徴量が得られるとみなす
+float FaceQuality( const cv::Mat& faces, int row )
+{
+    const float* face = faces.ptr<float>(row);
+    return face[sk_FaceScoreColumn] * std::min( face[2], face[3] );
+}
+
+size_t EntrySize( uint32_t dimension )
+{
+    return FaceIndex::sk_NameLength + sizeof(float) * dimension;
+}
+
+}
+
+FaceIndex::FaceIndex()
+    :
+      m_Fd( -1 ),
+      m_Map( nullptr ),
+      m_MapSize( 0 ),
+      m_Header( nullptr )
+{}
+
+FaceIndex::~FaceIndex()
+{
+    Close();
+}
+
+bool FaceIndex::Open( const std::string& path )
+{
+    if( m_Map != nullptr ){
+        return false;
+    }
+
+    int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+    if( fd < 0 ){
+        std::cerr << "FaceIndex: open failed. " << path << " " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if( fstat( fd, &st ) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header) ){
+        std::cerr << "FaceIndex: invalid index file. " << path << std::endl;
+        close( fd );
+        return false;
+    }
+
+    void* map = mmap( nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    if( map == MAP_FAILED ){
+        std::cerr << "FaceIndex: mmap failed. " << std::strerror(errno) << std::endl;
+        close( fd );
+        return false;
+    }
+
+    // Count はファイルサイズから逆算した上限と比べる (掛け算のオーバーフローを避ける)
+    const Header* header = static_cast<const Header*>(map);
+    if( header->Magic != Header::sk_Magic ||
+        header->Version != Header::sk_Version ||
+        header->Dimension == 0 ||
+        header->Dimension > sk_MaxDimension ||
+        header->Count > (static_cast<size_t>(st.st_size) - sizeof(Header)) / EntrySize( header->Dimension ) )
+    {
+        std::cerr << "FaceIndex: invalid index file. " << path << std::endl;
+        munmap( map, st.st_size );
+        close( fd );
+        return false;
+    }
+
+    m_Fd      = fd;
+    m_Map     = static_cast<const uint8_t*>(map);
+    m_MapSize = st.st_size;
+    m_Header  = header;
+
+    return true;
+}
+
+void FaceIndex::Close()
+{
+    if( m_Map != nullptr ){
+        munmap( const_cast<uint8_t*>(m_Map), m_MapSize );
+        m_Map = nullptr;
+        m_Header = nullptr;
+    }
+    if( m_Fd >= 0 ){
+        close( m_Fd );
+        m_Fd = -1;
+    }
+}
+
+uint32_t FaceIndex::Size() const
+{
+    return m_Header ? m_Header->Count : 0;
+}
+
+FaceIndex::Match FaceIndex::Search( const cv::Mat& feature ) const
+{
+    Match match = { -1, std::string(), 0.0f };
+    if( m_Header == nullptr || feature.type() != CV_32F || feature.total() != m_Header->Dimension ){
+        return match;
+    }
+
+    const float* query = feature.ptr<float>();
+    const uint32_t dimension = m_Header->Dimension;
+
+    // 登録数は多くても数百程度なので総当たりで十分
+    for( uint32_t i = 0; i < m_Header->Count; ++i ){
+        const float* entry = Feature( i );
+        float similarity = 0.0f;
+        for( uint32_t d = 0; d < dimension; ++d ){
+            similarity += query[d] * entry[d];
+        }
+
+        if( match.Index < 0 || similarity > match.Similarity ){
+            match.Index      = static_cast<int>(i);
+            match.Similarity = similarity;
+        }
+    }
+    if( match.Index >= 0 ){
+        match.Name = std::string( Name( match.Index ), strnlen( Name( match.Index ), sk_NameLength ) );
+    }
+
+    return match;
+}
+
+// 一時ファイルに書いてから rename し、読み込み中のプロセスに書きかけのファイルを見せない
+bool FaceIndex::Write( const std::string& path, const std::vector<std::string>& names, const std::vector<cv::Mat>& features )
+{
+    if( names.empty() || names.size() != features.size() ){
+        return false;
+    }
+
+    const uint32_t dimension = static_cast<uint32_t>(features[0].total());
+    if( dimension == 0 || dimension > sk_MaxDimension ){
+        return false;
+    }
+    for( const cv::Mat& feature : features ){
+        if( feature.type() != CV_32F || feature.total() != dimension || !feature.isContinuous() ){
+            return false;
+        }
+    }
+
+    Header header = { Header::sk_Magic, Header::sk_Version, dimension, static_cast<uint32_t>(names.size()) };
+
+    const std::string temp_path = path + ".tmp";
+    std::ofstream ofs( temp_path, std::ios::binary | std::ios::trunc );
+    ofs.write( reinterpret_cast<const char*>(&header), sizeof(header) );
+
+    for( size_t i = 0; i < names.size(); ++i ){
+        char name[sk_NameLength] = {};
+        std::strncpy( name, names[i].c_str(), sk_NameLength - 1 );
+        ofs.write( name, sizeof(name) );
+        ofs.write( reinterpret_cast<const char*>(features[i].ptr<float>()), sizeof(float) * dimension );
+    }
+
+    ofs.close();
+    if( ofs.fail() || std::rename( temp_path.c_str(), path.c_str() ) != 0 ){
+        std::remove( temp_path.c_str() );
+        return false;
+    }
+
+    return true;
+}
+
+const float* FaceIndex::Feature( uint32_t index ) const
+{
+    return reinterpret_cast<const float*>(m_Map + sizeof(Header) + EntrySize( m_Header->Dimension ) * index + sk_NameLength);
+}
+
+const char* FaceIndex::Name( uint32_t index ) const
+{
+    return reinterpret_cast<const char*>(m_Map + sizeof(Header) + EntrySize( m_Header->Dimension ) * index);
+}
+
+FaceTracker::FaceTracker()
+    :
+      m_Tracks(),
+      m_NextId( 1 )
+{}
+
+std::vector<size_t> FaceTracker::Update( const cv::Mat& faces )
+{
+    std::vector<size_t> assigned( faces.rows );
+    std::vector<bool> is_matched( m_Tracks.size(), false );
+
+    // IoU が最大の既存トラックに貪欲に割り当てる
+    for( int i = 0; i < faces.rows; ++i ){
+        const cv::Rect2f box = FaceBox( faces, i );
+
+        int best = -1;
+        float best_iou = sk_IoUThreshold;
+        for( size_t t = 0; t < m_Tracks.size(); ++t ){
+            if( is_matched[t] ){
+                continue;
+            }
+            const float iou = IoU( box, m_Tracks[t].Box );
+            if( iou >= best_iou ){
+                best = static_cast<int>(t);
+                best_iou = iou;
+            }
+        }
+
+        if( best < 0 ){
+            m_Tracks.push_back( { m_NextId++, box, 0, 0.0f, std::string(), 0.0f } );
+            is_matched.push_back( true );
+            best = static_cast<int>(m_Tracks.size() - 1);
+        }
+        else {
+            m_Tracks[best].Box = box;
+            m_Tracks[best].MissedCount = 0;
+            is_matched[best] = true;
+        }
+        assigned[i] = best;
+    }
+
+    // 見失ったトラックを一定回数で破棄する。添字が変わるので後ろから詰める
+    std::vector<size_t> remap( m_Tracks.size() );
+    size_t alive = 0;
+    for( size_t t = 0; t < m_Tracks.size(); ++t ){
+        if( !is_matched[t] && ++m_Tracks[t].MissedCount > sk_MaxMissedCount ){
+            continue;
+        }
+        remap[t] = alive;
+        if( alive != t ){
+            m_Tracks[alive] = m_Tracks[t];
+        }
+        ++alive;
+    }
+    m_Tracks.resize( alive );
+    for( size_t& index : assigned ){
+        index = remap[index];
+    }
+
+    return assigned;
+}
+
+FaceTracker::Track& FaceTracker::GetTrack( size_t index )
+{
+    return m_Tracks[index];
+}
+
+FaceRecognizer::FaceRecognizer()
+    :
+      m_Recognizer(),
+      m_Index(),
+      m_Tracker()
+{}
+
+bool FaceRecognizer::Open( const FaceRecognizer::Setting& setting )
+{
+    if( setting.ModelFilePath.empty() ){
+        return false;
+    }
+
+    try {
+        m_Recognizer = cv::FaceRecognizerSF::create( setting.ModelFilePath, "" );
+    }
+    catch( cv::Exception& e ){
+        std::cerr << e.what() << std::endl;
+        m_Recognizer.reset();
+        return false;
+    }
+
+    // インデックスが無くてもトラッキングと特徴量計算は行う (ラベルは空になる)
+    if( !setting.IndexFilePath.empty() && !m_Index.Open( setting.IndexFilePath ) ){
+        std::cerr << "Face index is not available. Faces will not be labeled." << std::endl;
+    }
+
+    return true;
+}
+
+bool FaceRecognizer::WarmUp()
+{
+    if( !IsOpened() ){
+        return false;
+    }
+
+    // SFace の整列先 (112x112) と同じ位置にランドマークを置いたダミーの検出結果
+    const float face[sk_FaceScoreColumn + 1] = {
+        0.0f, 0.0f, 112.0f, 112.0f,
+        38.2946f, 51.6963f, 73.5318f, 51.5014f, 56.0252f, 71.7366f, 41.5493f, 92.3655f, 70.7299f, 92.2041f,
+        1.0f
+    };
+
+    try {
+        cv::Mat dummy( 112, 112, CV_8UC3 );
+        cv::randu( dummy, cv::Scalar::all(0), cv::Scalar::all(255) );
+        ExtractFeature( dummy, cv::Mat( 1, sk_FaceScoreColumn + 1, CV_32F, const_cast<float*>(face) ).clone() );
+    }
+    catch( cv::Exception& e ){
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool FaceRecognizer::IsOpened() const
+{
+    return static_cast<bool>(m_Recognizer);
+}
+
+std::vector<FaceRecognizer::Result> FaceRecognizer::Recognize( const cv::Mat& image, const cv::Mat& faces )
+{
+    std::vector<Result> results;
+    if( !IsOpened() || faces.empty() ){
+        m_Tracker.Update( cv::Mat() );
+        return results;
+    }
+
+    const std::vector<size_t> tracks = m_Tracker.Update( faces );
+    for( int i = 0; i < faces.rows; ++i ){
+        FaceTracker::Track& track = m_Tracker.GetTrack( tracks[i] );
+        const float quality = FaceQuality( faces, i );
+
+        // 特徴量計算は重いので、新しいトラックか品質が十分に上がった時だけ行う
+        if( track.Quality <= 0.0f || quality > track.Quality * sk_RefreshQualityRatio ){
+            cv::Mat feature = ExtractFeature( image, faces.row(i) );
+            track.Quality = quality;
+
+            FaceIndex::Match match = m_Index.Search( feature );
+            if( match.Index >= 0 && match.Similarity >= sk_MatchThreshold ){
+                track.Label      = match.Name;
+                track.Similarity = match.Similarity;
+            }
+            else {
+                track.Label.clear();
+                track.Similarity = match.Similarity;
+            }
+        }
+
+        results.push_back( { track.Id, track.Label, track.Similarity } );
+    }
+
+    return results;
+}
+
+cv::Mat FaceRecognizer::ExtractFeature( const cv::Mat& image, const cv::Mat& face )
+{
+    cv::Mat aligned;
+    cv::Mat feature;
+    m_Recognizer->alignCrop( image, face, aligned );
+    m_Recognizer->feature( aligned, feature );
+
+    feature = feature.reshape( 1, 1 ).clone();
+    const double norm = cv::norm( feature );
+    if( norm > 0.0 ){
+        feature.convertTo( feature, CV_32F, 1.0 / norm );
+    }
+    return feature;
+}
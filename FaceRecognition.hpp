@@ -0,0 +1,143 @@
+#ifndef FACERECOGNITION_HPP_INCLUDED
+#define FACERECOGNITION_HPP_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include <opencv2/objdetect.hpp>
+
+// 登録済みの顔特徴量のインデックス
+//
+// ファイルをメモリマップして参照する。ファイル形式:
+//   [FaceIndex::Header][Entry 0]...[Entry Count-1]
+//   Entry = 名前 (sk_NameLength バイト, NUL 終端) + 特徴量 (float x Dimension, L2 正規化済み)
+class FaceIndex
+{
+public:
+
+    struct Header
+    {
+        static constexpr uint32_t sk_Magic   = 0x49464353;     // 'SCFI'
+        static constexpr uint32_t sk_Version = 1;
+
+        uint32_t Magic;
+        uint32_t Version;
+        uint32_t Dimension;
+        uint32_t Count;
+    };
+
+    struct Match
+    {
+        int         Index;          // -1 = 該当なし
+        std::string Name;
+        float       Similarity;     // コサイン類似度
+    };
+
+    static constexpr size_t sk_NameLength = 64;
+    // 特徴量の次元の上限 (SFace は 128)。壊れたファイルで巨大なサイズを計算しないため
+    static constexpr uint32_t sk_MaxDimension = 4096;
+
+    FaceIndex();
+    ~FaceIndex();
+    FaceIndex( const FaceIndex& ) = delete;
+    FaceIndex& operator=( const FaceIndex& ) = delete;
+
+    bool Open( const std::string& path );
+    void Close();
+    uint32_t Size() const;
+    // feature は L2 正規化済みであること
+    Match Search( const cv::Mat& feature ) const;
+
+    static bool Write( const std::string& path, const std::vector<std::string>& names, const std::vector<cv::Mat>& features );
+
+private:
+
+    const float* Feature( uint32_t index ) const;
+    const char* Name( uint32_t index ) const;
+
+    int            m_Fd;
+    const uint8_t* m_Map;
+    size_t         m_MapSize;
+    const Header*  m_Header;
+};
+
+// 前フレームとの IoU で検出結果にトラック ID を振る
+class FaceTracker
+{
+public:
+
+    struct Track
+    {
+        int         Id;
+        cv::Rect2f  Box;
+        int         MissedCount;
+        float       Quality;        // 特徴量を計算した時点の品質。0 = 未計算
+        std::string Label;
+        float       Similarity;
+    };
+
+    static constexpr float sk_IoUThreshold  = 0.3f;
+    static constexpr int   sk_MaxMissedCount = 5;
+
+    FaceTracker();
+
+    // faces の各行に対応するトラックの添字を返す
+    std::vector<size_t> Update( const cv::Mat& faces );
+    Track& GetTrack( size_t index );
+
+private:
+
+    std::vector<Track> m_Tracks;
+    int m_NextId;
+};
+
+// 顔検出結果に対する認識処理
+//
+// 特徴量 (SFace) はトラックごとに 1 回だけ計算し、顔の品質が十分に
+// 良くなった場合にのみ再計算する。
+class FaceRecognizer
+{
+public:
+
+    struct Setting
+    {
+        std::string ModelFilePath;      // 空なら認識しない
+        std::string IndexFilePath;
+    };
+
+    struct Result
+    {
+        int         TrackId;
+        std::string Label;              // 未登録の顔は空
+        float       Similarity;
+    };
+
+    // SFace のコサイン類似度の推奨しきい値
+    static constexpr float sk_MatchThreshold      = 0.363f;
+    // 品質がこの倍率を超えて良くなったら特徴量を再計算する
+    static constexpr float sk_RefreshQualityRatio = 1.2f;
+
+    FaceRecognizer();
+    ~FaceRecognizer() = default;
+    FaceRecognizer( const FaceRecognizer& ) = delete;
+    FaceRecognizer& operator=( const FaceRecognizer& ) = delete;
+
+    bool Open( const FaceRecognizer::Setting& setting );
+    // 初回の特徴量計算ではネットワークの構築やメモリ確保が走るので、ダミー画像で一度計算しておく
+    bool WarmUp();
+    bool IsOpened() const;
+    // faces は FaceDetectorYN の検出結果 (image と同じ座標系)
+    std::vector<Result> Recognize( const cv::Mat& image, const cv::Mat& faces );
+
+    // face (検出結果 1 行) のランドマークで顔を整列し、L2 正規化した特徴量を求める
+    cv::Mat ExtractFeature( const cv::Mat& image, const cv::Mat& face );
+
+private:
+
+    cv::Ptr<cv::FaceRecognizerSF> m_Recognizer;
+    FaceIndex                     m_Index;
+    FaceTracker                   m_Tracker;
+};
+
+#endif  // FACERECOGNITION_HPP_INCLUDED
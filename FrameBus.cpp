@@ -0,0 +1,344 @@
+
+#include "FrameBus.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t sk_Alignment = 64;
+
+// Magic が書かれていないセグメントを初期化途中とみなす猶予
+constexpr time_t sk_StaleGraceSeconds = 5;
+
+size_t AlignUp( size_t size )
+{
+    return (size + sk_Alignment - 1) & ~(sk_Alignment - 1);
+}
+
+size_t HeaderAreaSize()
+{
+    return AlignUp( sizeof(FrameBusHeader) );
+}
+
+size_t SlotHeaderAreaSize()
+{
+    return AlignUp( sizeof(FrameBusSlot) );
+}
+
+}
+
+FrameBusPublisher::FrameBusPublisher()
+    :
+      m_Name(),
+      m_Fd( -1 ),
+      m_Map( nullptr ),
+      m_MapSize( 0 ),
+      m_Header( nullptr )
+{}
+
+FrameBusPublisher::~FrameBusPublisher()
+{
+    Close();
+}
+
+bool FrameBusPublisher::Open( const std::string& name, cv::Size size, int type, uint32_t slot_count )
+{
+    if( m_Map != nullptr || slot_count == 0 ){
+        return false;
+    }
+
+    const size_t image_bytes = AlignUp( static_cast<size_t>(size.width) * size.height * CV_ELEM_SIZE(type) );
+    const size_t slot_size   = SlotHeaderAreaSize() + image_bytes;
+    const size_t map_size    = HeaderAreaSize() + slot_size * slot_count;
+
+    int fd = shm_open( name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644 );
+    if( fd < 0 && errno == EEXIST && RemoveStaleSegment( name ) ){
+        fd = shm_open( name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644 );
+    }
+    if( fd < 0 ){
+        std::cerr << "FrameBus: shm_open failed. " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    if( ftruncate( fd, static_cast<off_t>(map_size) ) != 0 ){
+        std::cerr << "FrameBus: ftruncate failed. " << std::strerror(errno) << std::endl;
+        close( fd );
+        shm_unlink( name.c_str() );
+        return false;
+    }
+
+    void* map = mmap( nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if( map == MAP_FAILED ){
+        std::cerr << "FrameBus: mmap failed. " << std::strerror(errno) << std::endl;
+        close( fd );
+        shm_unlink( name.c_str() );
+        return false;
+    }
+
+    m_Name    = name;
+    m_Fd      = fd;
+    m_Map     = static_cast<uint8_t*>(map);
+    m_MapSize = map_size;
+
+    // ftruncate 直後はゼロ埋めされているので Lock / LatestSequence は 0 から始まる
+    m_Header = reinterpret_cast<FrameBusHeader*>(m_Map);
+    m_Header->SlotCount     = slot_count;
+    m_Header->MaxFaces      = FrameBusSlot::sk_MaxFaces;
+    m_Header->SlotSize      = slot_size;
+    m_Header->MaxImageBytes = image_bytes;
+    m_Header->OwnerPid      = static_cast<int32_t>(getpid());
+    m_Header->Version       = FrameBusHeader::sk_Version;
+    // Magic は最後に書き込み、読み出し側が初期化途中のヘッダを参照しないようにする
+    std::atomic_thread_fence( std::memory_order_release );
+    m_Header->Magic         = FrameBusHeader::sk_Magic;
+
+    return true;
+}
+
+bool FrameBusPublisher::Publish( const cv::Mat& image, uint64_t sequence, int64_t timestamp_ns,
+                                 const cv::Mat& faces, uint64_t detection_sequence, int64_t detection_timestamp_ns )
+{
+    if( m_Map == nullptr || sequence == 0 || image.empty() ){
+        return false;
+    }
+
+    const size_t row_bytes = static_cast<size_t>(image.cols) * image.elemSize();
+    if( row_bytes * image.rows > m_Header->MaxImageBytes ){
+        return false;
+    }
+
+    uint8_t* base = m_Map + HeaderAreaSize() + (sequence % m_Header->SlotCount) * m_Header->SlotSize;
+    FrameBusSlot* slot = reinterpret_cast<FrameBusSlot*>(base);
+    uint8_t* data = base + SlotHeaderAreaSize();
+
+    slot->Lock.store( sequence * 2 - 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+
+    slot->FrameSequence = sequence;
+    slot->TimestampNs   = timestamp_ns;
+    slot->Width         = image.cols;
+    slot->Height        = image.rows;
+    slot->Type          = image.type();
+    slot->Step          = static_cast<uint32_t>(row_bytes);
+
+    uint32_t face_count = 0;
+    if( !faces.empty() && faces.type() == CV_32F && faces.cols >= FrameBusSlot::sk_FaceElements ){
+        face_count = std::min<uint32_t>( faces.rows, FrameBusSlot::sk_MaxFaces );
+        for( uint32_t i = 0; i < face_count; ++i ){
+            std::memcpy( slot->Faces[i], faces.ptr<float>(i), sizeof(slot->Faces[i]) );
+        }
+    }
+    slot->FaceCount            = face_count;
+    slot->DetectionSequence    = detection_sequence;
+    slot->DetectionTimestampNs = detection_timestamp_ns;
+
+    if( image.isContinuous() ){
+        std::memcpy( data, image.data, row_bytes * image.rows );
+    }
+    else {
+        for( int y = 0; y < image.rows; ++y ){
+            std::memcpy( data + row_bytes * y, image.ptr(y), row_bytes );
+        }
+    }
+
+    slot->Lock.store( sequence * 2, std::memory_order_release );
+    m_Header->LatestSequence.store( sequence, std::memory_order_release );
+
+    return true;
+}
+
+// 前回異常終了時の残骸であれば削除する。書き込み側がまだ生きていれば削除しない
+bool FrameBusPublisher::RemoveStaleSegment( const std::string& name )
+{
+    int fd = shm_open( name.c_str(), O_RDONLY, 0 );
+    if( fd < 0 ){
+        // 調べている間に消えた
+        return errno == ENOENT;
+    }
+
+    bool has_owner = false;
+    pid_t owner = 0;
+    struct stat st;
+    if( fstat( fd, &st ) != 0 ){
+        close( fd );
+        return false;
+    }
+    if( static_cast<size_t>(st.st_size) >= HeaderAreaSize() ){
+        void* map = mmap( nullptr, HeaderAreaSize(), PROT_READ, MAP_SHARED, fd, 0 );
+        if( map != MAP_FAILED ){
+            const FrameBusHeader* header = static_cast<const FrameBusHeader*>(map);
+            std::atomic_thread_fence( std::memory_order_acquire );
+            if( header->Magic == FrameBusHeader::sk_Magic && header->Version == FrameBusHeader::sk_Version ){
+                has_owner = true;
+                owner = header->OwnerPid;
+            }
+            munmap( map, HeaderAreaSize() );
+        }
+    }
+    close( fd );
+
+    if( has_owner ){
+        if( owner <= 0 || kill( owner, 0 ) == 0 || errno == EPERM ){
+            std::cerr << "FrameBus: " << name << " is used by process " << owner << "." << std::endl;
+            return false;
+        }
+    }
+    else if( time( nullptr ) - st.st_mtime < sk_StaleGraceSeconds ){
+        // 別の書き込み側が初期化している最中かもしれない
+        std::cerr << "FrameBus: " << name << " is being initialized by another process." << std::endl;
+        return false;
+    }
+
+    shm_unlink( name.c_str() );
+    return true;
+}
+
+void FrameBusPublisher::Close()
+{
+    if( m_Map != nullptr ){
+        munmap( m_Map, m_MapSize );
+        m_Map = nullptr;
+        m_Header = nullptr;
+    }
+    if( m_Fd >= 0 ){
+        close( m_Fd );
+        m_Fd = -1;
+        shm_unlink( m_Name.c_str() );
+    }
+}
+
+FrameBusReader::FrameBusReader()
+    :
+      m_Fd( -1 ),
+      m_Map( nullptr ),
+      m_MapSize( 0 ),
+      m_Header( nullptr )
+{}
+
+FrameBusReader::~FrameBusReader()
+{
+    Close();
+}
+
+bool FrameBusReader::Open( const std::string& name )
+{
+    if( m_Map != nullptr ){
+        return false;
+    }
+
+    int fd = shm_open( name.c_str(), O_RDONLY, 0 );
+    if( fd < 0 ){
+        std::cerr << "FrameBus: shm_open failed. " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if( fstat( fd, &st ) != 0 || static_cast<size_t>(st.st_size) < HeaderAreaSize() ){
+        close( fd );
+        return false;
+    }
+
+    void* map = mmap( nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    if( map == MAP_FAILED ){
+        std::cerr << "FrameBus: mmap failed. " << std::strerror(errno) << std::endl;
+        close( fd );
+        return false;
+    }
+
+    const FrameBusHeader* header = static_cast<const FrameBusHeader*>(map);
+    std::atomic_thread_fence( std::memory_order_acquire );
+    if( header->Magic != FrameBusHeader::sk_Magic ||
+        header->Version != FrameBusHeader::sk_Version ||
+        HeaderAreaSize() + header->SlotSize * header->SlotCount > static_cast<size_t>(st.st_size) )
+    {
+        std::cerr << "FrameBus: invalid shared memory layout." << std::endl;
+        munmap( map, st.st_size );
+        close( fd );
+        return false;
+    }
+
+    m_Fd      = fd;
+    m_Map     = static_cast<const uint8_t*>(map);
+    m_MapSize = st.st_size;
+    m_Header  = header;
+
+    return true;
+}
+
+uint64_t FrameBusReader::LatestSequence() const
+{
+    if( m_Header == nullptr ){
+        return 0;
+    }
+    return m_Header->LatestSequence.load( std::memory_order_acquire );
+}
+
+bool FrameBusReader::Acquire( uint64_t sequence, View& view ) const
+{
+    if( m_Map == nullptr || sequence == 0 ){
+        return false;
+    }
+
+    const uint8_t* base = m_Map + HeaderAreaSize() + (sequence % m_Header->SlotCount) * m_Header->SlotSize;
+    const FrameBusSlot* slot = reinterpret_cast<const FrameBusSlot*>(base);
+
+    // 書き込み中、もしくは既に別のフレームで上書きされている
+    uint64_t lock = slot->Lock.load( std::memory_order_acquire );
+    if( lock != sequence * 2 ){
+        return false;
+    }
+
+    // 共有メモリ上の値は信用せず、一度だけ読んでから検査する
+    const int width  = slot->Width;
+    const int height = slot->Height;
+    const int type   = slot->Type;
+    const size_t step = slot->Step;
+    if( width <= 0 || height <= 0 || type != CV_MAT_TYPE(type) || CV_MAT_DEPTH(type) > CV_64F ){
+        return false;
+    }
+    if( static_cast<size_t>(width) * CV_ELEM_SIZE(type) > step ||
+        step * static_cast<size_t>(height) > m_Header->MaxImageBytes )
+    {
+        return false;
+    }
+
+    uint8_t* data = const_cast<uint8_t*>(base + SlotHeaderAreaSize());
+    const int face_count = static_cast<int>(std::min<uint32_t>( slot->FaceCount, FrameBusSlot::sk_MaxFaces ));
+
+    view.Slot  = slot;
+    view.Lock  = lock;
+    view.Image = cv::Mat( height, width, type, data, step );
+    view.Faces = cv::Mat( face_count, FrameBusSlot::sk_FaceElements, CV_32F, const_cast<float*>(&slot->Faces[0][0]) );
+
+    return true;
+}
+
+bool FrameBusReader::Validate( const View& view ) const
+{
+    if( view.Slot == nullptr ){
+        return false;
+    }
+    std::atomic_thread_fence( std::memory_order_acquire );
+    return view.Slot->Lock.load( std::memory_order_relaxed ) == view.Lock;
+}
+
+void FrameBusReader::Close()
+{
+    if( m_Map != nullptr ){
+        munmap( const_cast<uint8_t*>(m_Map), m_MapSize );
+        m_Map = nullptr;
+        m_Header = nullptr;
+    }
+    if( m_Fd >= 0 ){
+        close( m_Fd );
+        m_Fd = -1;
+    }
+}
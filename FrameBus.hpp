@@ -0,0 +1,119 @@
+#ifndef FRAMEBUS_HPP_INCLUDED
+#define FRAMEBUS_HPP_INCLUDED
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <opencv2/opencv.hpp>
+
+// 共有メモリ上のフレームリングバッファ
+//
+// レイアウト: [FrameBusHeader][FrameBusSlot + 画像データ] x SlotCount
+// 各スロットは seqlock で保護しており、書き込み中は Sequence が奇数になる。
+// 読み出し側は読み出し前後で Sequence が一致していることを確認すればよく、
+// 書き込み側(カメラループ)が読み出し側を待つことはない。
+
+struct FrameBusHeader
+{
+    static constexpr uint32_t sk_Magic   = 0x53434642;     // 'SCFB'
+    static constexpr uint32_t sk_Version = 2;
+
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t SlotCount;
+    uint32_t MaxFaces;
+    uint64_t SlotSize;          // スロットヘッダ + 画像データ領域のバイト数
+    uint64_t MaxImageBytes;
+    // 書き込み側のプロセス ID。生きている間は別のプロセスが同じ名前で開けない
+    int32_t  OwnerPid;
+    uint32_t Reserved;
+    // 最後に書き込みが完了したフレームのシーケンス番号(0 = まだ無し)
+    std::atomic<uint64_t> LatestSequence;
+};
+
+struct FrameBusSlot
+{
+    // FaceDetectorYN の検出結果 1 件分の要素数 (bbox 4, landmark 10, score 1)
+    static constexpr int sk_FaceElements = 15;
+    static constexpr int sk_MaxFaces     = 16;
+
+    // seqlock。書き込み中は奇数、書き込み完了後は偶数。
+    std::atomic<uint64_t> Lock;
+    uint64_t FrameSequence;
+    int64_t  TimestampNs;       // CLOCK_MONOTONIC
+    int32_t  Width;
+    int32_t  Height;
+    int32_t  Type;              // cv::Mat::type()
+    uint32_t Step;
+    uint32_t FaceCount;
+    uint32_t Reserved;
+    // Faces はこのフレームではなく、非同期に検出を終えた過去のフレームの結果。
+    // その検出元フレームのシーケンス番号と時刻 (0 = 検出結果なし)
+    uint64_t DetectionSequence;
+    int64_t  DetectionTimestampNs;
+    float    Faces[sk_MaxFaces][sk_FaceElements];
+};
+
+class FrameBusPublisher
+{
+public:
+
+    static constexpr int sk_DefaultSlotCount = 4;
+
+    FrameBusPublisher();
+    ~FrameBusPublisher();
+    FrameBusPublisher( const FrameBusPublisher& ) = delete;
+    FrameBusPublisher& operator=( const FrameBusPublisher& ) = delete;
+
+    // 同じ名前の共有メモリを別の生きているプロセスが使っている場合は失敗する
+    bool Open( const std::string& name, cv::Size size, int type, uint32_t slot_count = sk_DefaultSlotCount );
+    // faces は detection_sequence のフレームで検出した結果
+    bool Publish( const cv::Mat& image, uint64_t sequence, int64_t timestamp_ns,
+                  const cv::Mat& faces, uint64_t detection_sequence, int64_t detection_timestamp_ns );
+    void Close();
+
+private:
+
+    static bool RemoveStaleSegment( const std::string& name );
+
+    std::string     m_Name;
+    int             m_Fd;
+    uint8_t*        m_Map;
+    size_t          m_MapSize;
+    FrameBusHeader* m_Header;
+};
+
+class FrameBusReader
+{
+public:
+
+    // 共有メモリ上のフレームを直接参照するビュー。
+    // 使い終わったら Validate() で上書きされていないことを確認すること。
+    struct View
+    {
+        const FrameBusSlot* Slot;
+        uint64_t            Lock;
+        cv::Mat             Image;      // 共有メモリを直接参照する(読み出し専用)
+        cv::Mat             Faces;      // FaceCount x 15 の CV_32F
+    };
+
+    FrameBusReader();
+    ~FrameBusReader();
+    FrameBusReader( const FrameBusReader& ) = delete;
+    FrameBusReader& operator=( const FrameBusReader& ) = delete;
+
+    bool Open( const std::string& name );
+    uint64_t LatestSequence() const;
+    bool Acquire( uint64_t sequence, View& view ) const;
+    bool Validate( const View& view ) const;
+    void Close();
+
+private:
+
+    int                   m_Fd;
+    const uint8_t*        m_Map;
+    size_t                m_MapSize;
+    const FrameBusHeader* m_Header;
+};
+
+#endif  // FRAMEBUS_HPP_INCLUDED
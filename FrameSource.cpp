@@ -0,0 +1,216 @@
+
+#include "FrameSource.hpp"
+
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+
+V4L2FrameSource::V4L2FrameSource( const std::string& device, DetectorInputFormat format )
+    :
+      m_Device( device ),
+      m_Format( format ),
+      m_Capture()
+{}
+
+bool V4L2FrameSource::Open()
+{
+    // cv::VideoCapture.set() では設定できなかったので、
+    // gstreamer のパイプラインから指定
+    if( m_Format == DETECTOR_INPUT_YUYV ){
+        if( !m_Capture.open( "v4l2src device=" + m_Device + " ! video/x-raw,format=YUY2,width=1280,height=720,framerate=(fraction)30/1 ! appsink max-buffers=1 drop=True",
+                             cv::CAP_GSTREAMER ) )
+        {
+            return false;
+        }
+        // YUY2 を BGR に変換せず CV_8UC2 のまま受け取る。
+        // 対応していない OpenCV では BGR で返るが、SurveillanceCamera はフレームの型で判断する
+        m_Capture.set( cv::CAP_PROP_CONVERT_RGB, 0 );
+        return true;
+    }
+
+    return m_Capture.open( "v4l2src device=" + m_Device + " ! image/jpeg,width=1280, height=720, framerate=(fraction)30/1 !jpegdec !videoconvert ! appsink max-buffers=1 drop=True",
+                           cv::CAP_GSTREAMER );
+}
+
+bool V4L2FrameSource::IsOpened() const
+{
+    return m_Capture.isOpened();
+}
+
+bool V4L2FrameSource::IsExhausted() const
+{
+    // カメラは終わらない。読み出しの失敗は再接続で回復させる
+    return false;
+}
+
+bool V4L2FrameSource::Read( cv::Mat& frame )
+{
+    return m_Capture.read( frame );
+}
+
+void V4L2FrameSource::Release()
+{
+    m_Capture.release();
+}
+
+cv::Size V4L2FrameSource::GetFrameSize() const
+{
+    return { static_cast<int>(m_Capture.get(cv::CAP_PROP_FRAME_WIDTH)), static_cast<int>(m_Capture.get(cv::CAP_PROP_FRAME_HEIGHT)) };
+}
+
+double V4L2FrameSource::GetFps() const
+{
+    return m_Capture.get( cv::CAP_PROP_FPS );
+}
+
+DetectorInputFormat V4L2FrameSource::GetFormat() const
+{
+    return m_Format;
+}
+
+VideoFileFrameSource::VideoFileFrameSource( const std::string& path, bool loop )
+    :
+      m_Path( path ),
+      m_Loop( loop ),
+      m_IsExhausted( false ),
+      m_Capture()
+{}
+
+bool VideoFileFrameSource::Open()
+{
+    m_IsExhausted = false;
+    return m_Capture.open( m_Path );
+}
+
+bool VideoFileFrameSource::IsOpened() const
+{
+    return m_Capture.isOpened();
+}
+
+bool VideoFileFrameSource::IsExhausted() const
+{
+    return m_IsExhausted;
+}
+
+bool VideoFileFrameSource::Read( cv::Mat& frame )
+{
+    if( m_Capture.read( frame ) ){
+        return true;
+    }
+    if( !m_Loop ){
+        m_IsExhausted = true;
+        return false;
+    }
+
+    m_Capture.set( cv::CAP_PROP_POS_FRAMES, 0 );
+    return m_Capture.read( frame );
+}
+
+void VideoFileFrameSource::Release()
+{
+    m_Capture.release();
+}
+
+cv::Size VideoFileFrameSource::GetFrameSize() const
+{
+    return { static_cast<int>(m_Capture.get(cv::CAP_PROP_FRAME_WIDTH)), static_cast<int>(m_Capture.get(cv::CAP_PROP_FRAME_HEIGHT)) };
+}
+
+double VideoFileFrameSource::GetFps() const
+{
+    return m_Capture.get( cv::CAP_PROP_FPS );
+}
+
+DetectorInputFormat VideoFileFrameSource::GetFormat() const
+{
+    return DETECTOR_INPUT_BGR;
+}
+
+SyntheticFrameSource::SyntheticFrameSource( cv::Size size, double fps, DetectorInputFormat format )
+    :
+      m_Size( size ),
+      m_Fps( fps ),
+      m_Format( format ),
+      m_IsOpened( false ),
+      m_FrameCount( 0 )
+{}
+
+bool SyntheticFrameSource::Open()
+{
+    m_IsOpened = true;
+    m_FrameCount = 0;
+    return true;
+}
+
+bool SyntheticFrameSource::IsOpened() const
+{
+    return m_IsOpened;
+}
+
+bool SyntheticFrameSource::IsExhausted() const
+{
+    return false;
+}
+
+bool SyntheticFrameSource::Read( cv::Mat& frame )
+{
+    if( !m_IsOpened ){
+        return false;
+    }
+
+    // カメラと同様、毎フレーム新しいバッファを返す
+    // (呼び出し側は受け取ったフレームを顔検出スレッドやキューへそのまま渡すため)
+    const int shift = static_cast<int>(m_FrameCount % 256);
+    const int box = std::min( m_Size.width, m_Size.height ) / 4;
+    const int range = std::max( m_Size.width - box, 1 );
+    const cv::Rect2i moving_box( static_cast<int>((m_FrameCount * 8) % range), (m_Size.height - box) / 2, box, box );
+
+    // 横方向のグラデーションの上を矩形が移動するパターン
+    if( m_Format == DETECTOR_INPUT_YUYV ){
+        // Y にグラデーション、U/V に縦横の変化を入れる (2 画素で U, V を共有)
+        frame = cv::Mat( m_Size, CV_8UC2 );
+        for( int y = 0; y < frame.rows; ++y ){
+            uint8_t* p = frame.ptr<uint8_t>(y);
+            for( int x = 0; x < frame.cols; ++x ){
+                p[x * 2 + 0] = static_cast<uint8_t>(x + shift);
+                p[x * 2 + 1] = static_cast<uint8_t>((x & 1) ? y : x + y);
+            }
+        }
+        cv::rectangle( frame, moving_box, cv::Scalar(235, 128), -1 );
+    }
+    else {
+        frame = cv::Mat( m_Size, CV_8UC3 );
+        for( int y = 0; y < frame.rows; ++y ){
+            uint8_t* p = frame.ptr<uint8_t>(y);
+            for( int x = 0; x < frame.cols; ++x ){
+                p[x * 3 + 0] = static_cast<uint8_t>(x + shift);
+                p[x * 3 + 1] = static_cast<uint8_t>(y);
+                p[x * 3 + 2] = static_cast<uint8_t>(x + y);
+            }
+        }
+        cv::rectangle( frame, moving_box, cv::Scalar(255, 255, 255), -1 );
+    }
+
+    ++m_FrameCount;
+    return true;
+}
+
+void SyntheticFrameSource::Release()
+{
+    m_IsOpened = false;
+}
+
+cv::Size SyntheticFrameSource::GetFrameSize() const
+{
+    return m_Size;
+}
+
+double SyntheticFrameSource::GetFps() const
+{
+    return m_Fps;
+}
+
+DetectorInputFormat SyntheticFrameSource::GetFormat() const
+{
+    return m_Format;
+}
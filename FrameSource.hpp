@@ -0,0 +1,118 @@
+#ifndef FRAMESOURCE_HPP_INCLUDED
+#define FRAMESOURCE_HPP_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include <opencv2/opencv.hpp>
+
+#include "DetectorPreprocess.hpp"
+
+// SurveillanceCamera へフレームを供給するインタフェース
+// カメラが無い環境でもパイプライン全体を動かせるよう、入力元を差し替え可能にする
+class FrameSource
+{
+public:
+
+    virtual ~FrameSource() = default;
+
+    virtual bool Open() = 0;
+    virtual bool IsOpened() const = 0;
+    // 読み出しに失敗した場合は false を返すか、cv::Exception を送出する
+    virtual bool Read( cv::Mat& frame ) = 0;
+    // 入力が終わっていてこれ以上フレームが無い (動画ファイルの末尾など) なら true。
+    // Read() の失敗が一時的な不調か、開き直しても回復しない終端かを区別するのに使う
+    virtual bool IsExhausted() const = 0;
+    virtual void Release() = 0;
+    virtual cv::Size GetFrameSize() const = 0;
+    virtual double GetFps() const = 0;
+    // Read() が返すフレームの形式 (BGR: CV_8UC3, YUYV: CV_8UC2)
+    virtual DetectorInputFormat GetFormat() const = 0;
+};
+
+// USB カメラ (V4L2) から GStreamer 経由で取得する
+//
+// DETECTOR_INPUT_BGR: カメラの MJPEG を jpegdec + videoconvert で BGR にして渡す (既定)
+// DETECTOR_INPUT_YUYV: カメラの非圧縮 YUYV をそのまま渡す。videoconvert を通さないので、
+//                      BGR への変換は SurveillanceCamera が行い、検出器の入力は YUYV から直接作る。
+//                      USB 2.0 のカメラでは 1280x720 の YUYV は 30fps が出ないことが多い
+class V4L2FrameSource : public FrameSource
+{
+public:
+
+    static constexpr const char* sk_DefaultDevice = "/dev/video0";
+
+    explicit V4L2FrameSource( const std::string& device = sk_DefaultDevice, DetectorInputFormat format = DETECTOR_INPUT_BGR );
+    V4L2FrameSource( const V4L2FrameSource& ) = delete;
+    V4L2FrameSource& operator=( const V4L2FrameSource& ) = delete;
+
+    bool Open() override;
+    bool IsOpened() const override;
+    bool Read( cv::Mat& frame ) override;
+    bool IsExhausted() const override;
+    void Release() override;
+    cv::Size GetFrameSize() const override;
+    double GetFps() const override;
+    DetectorInputFormat GetFormat() const override;
+
+private:
+
+    std::string         m_Device;
+    DetectorInputFormat m_Format;
+    cv::VideoCapture    m_Capture;
+};
+
+// 動画ファイルから取得する。loop なら末尾まで読んだら先頭に戻り、そうでなければ終端になる
+class VideoFileFrameSource : public FrameSource
+{
+public:
+
+    VideoFileFrameSource( const std::string& path, bool loop = true );
+    VideoFileFrameSource( const VideoFileFrameSource& ) = delete;
+    VideoFileFrameSource& operator=( const VideoFileFrameSource& ) = delete;
+
+    bool Open() override;
+    bool IsOpened() const override;
+    bool Read( cv::Mat& frame ) override;
+    bool IsExhausted() const override;
+    void Release() override;
+    cv::Size GetFrameSize() const override;
+    double GetFps() const override;
+    DetectorInputFormat GetFormat() const override;
+
+private:
+
+    std::string      m_Path;
+    bool             m_Loop;
+    bool             m_IsExhausted;
+    cv::VideoCapture m_Capture;
+};
+
+// テストパターンを生成する。フレームレートの調整は呼び出し側で行う
+// format に DETECTOR_INPUT_YUYV を指定すると、YUYV カメラと同じ形式で返す
+class SyntheticFrameSource : public FrameSource
+{
+public:
+
+    SyntheticFrameSource( cv::Size size, double fps, DetectorInputFormat format = DETECTOR_INPUT_BGR );
+    SyntheticFrameSource( const SyntheticFrameSource& ) = delete;
+    SyntheticFrameSource& operator=( const SyntheticFrameSource& ) = delete;
+
+    bool Open() override;
+    bool IsOpened() const override;
+    bool Read( cv::Mat& frame ) override;
+    bool IsExhausted() const override;
+    void Release() override;
+    cv::Size GetFrameSize() const override;
+    double GetFps() const override;
+    DetectorInputFormat GetFormat() const override;
+
+private:
+
+    cv::Size m_Size;
+    double   m_Fps;
+    DetectorInputFormat m_Format;
+    bool     m_IsOpened;
+    uint64_t m_FrameCount;
+};
+
+#endif  // FRAMESOURCE_HPP_INCLUDED
@@ -0,0 +1,200 @@
+
+#include "FrameTrace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <string>
+
+namespace {
+
+const char* TrackName( TraceTrack track )
+{
+    switch( track ){
+    case TRACK_CAPTURE:
+        return "Capture";
+    case TRACK_DETECTOR:
+        return "FaceDetector";
+    case TRACK_WEB_STREAM_WRITER:
+        return "WebStreamWriter";
+    case TRACK_FACE_RECORDER:
+        return "DetectedFaceRecorder";
+    default:
+        return "Unknown";
+    }
+}
+
+double NsToUs( int64_t ns )
+{
+    return static_cast<double>(ns) / 1000.0;
+}
+
+double NsToMs( int64_t ns )
+{
+    return static_cast<double>(ns) / 1000000.0;
+}
+
+}
+
+int64_t TraceNowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+FrameTracer::FrameTracer( size_t capacity )
+    :
+      m_Events( new Event[capacity] ),
+      m_Capacity( capacity ),
+      m_Next( 0 )
+{
+    for( size_t i = 0; i < m_Capacity; ++i ){
+        m_Events[i].Commit.store( 0 );
+    }
+}
+
+void FrameTracer::Record( const char* name, TraceTrack track, uint64_t sequence, int64_t begin_ns, int64_t end_ns )
+{
+    const uint64_t index = m_Next.fetch_add( 1, std::memory_order_relaxed );
+    Event& event = m_Events[index % m_Capacity];
+
+    // 書き込み中は Commit を 0 にしておき、Dump 側で読み飛ばさせる
+    event.Commit.store( 0, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+
+    event.Name     = name;
+    event.Track    = track;
+    event.Sequence = sequence;
+    event.BeginNs  = begin_ns;
+    event.EndNs    = end_ns;
+
+    event.Commit.store( index + 1, std::memory_order_release );
+}
+
+void FrameTracer::DumpChromeTrace( std::ostream& os ) const
+{
+    const uint64_t next  = m_Next.load( std::memory_order_acquire );
+    const uint64_t first = (next > m_Capacity) ? next - m_Capacity : 0;
+
+    os << std::fixed << std::setprecision( 3 );
+    os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    bool is_first = true;
+    for( int track = TRACK_CAPTURE; track < TRACK_MAX; ++track ){
+        os << (is_first ? "" : ",")
+           << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track
+           << ",\"args\":{\"name\":\"" << TrackName( static_cast<TraceTrack>(track) ) << "\"}}";
+        is_first = false;
+    }
+
+    for( uint64_t index = first; index < next; ++index ){
+        const Event& event = m_Events[index % m_Capacity];
+
+        if( event.Commit.load( std::memory_order_acquire ) != index + 1 ){
+            continue;
+        }
+        const char* name     = event.Name;
+        TraceTrack  track    = event.Track;
+        uint64_t    sequence = event.Sequence;
+        int64_t     begin_ns = event.BeginNs;
+        int64_t     end_ns   = event.EndNs;
+        std::atomic_thread_fence( std::memory_order_acquire );
+        // 読み出し中に上書きされた
+        if( event.Commit.load( std::memory_order_relaxed ) != index + 1 ){
+            continue;
+        }
+
+        os << ",{\"name\":\"" << name << "\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":" << track
+           << ",\"ts\":" << NsToUs( begin_ns )
+           << ",\"dur\":" << NsToUs( end_ns - begin_ns )
+           << ",\"args\":{\"frame\":" << sequence << "}}";
+    }
+
+    os << "]}" << std::endl;
+}
+
+std::vector<int64_t> FrameTracer::CollectDurations( const char* name ) const
+{
+    const uint64_t next  = m_Next.load( std::memory_order_acquire );
+    const uint64_t first = (next > m_Capacity) ? next - m_Capacity : 0;
+    const std::string target( name );
+
+    std::vector<int64_t> durations;
+    for( uint64_t index = first; index < next; ++index ){
+        const Event& event = m_Events[index % m_Capacity];
+
+        if( event.Commit.load( std::memory_order_acquire ) != index + 1 ){
+            continue;
+        }
+        const char* event_name = event.Name;
+        int64_t     duration   = event.EndNs - event.BeginNs;
+        std::atomic_thread_fence( std::memory_order_acquire );
+        if( event.Commit.load( std::memory_order_relaxed ) != index + 1 ){
+            continue;
+        }
+
+        if( target == event_name ){
+            durations.push_back( duration );
+        }
+    }
+
+    return durations;
+}
+
+LatencyStats::LatencyStats( size_t window )
+    :
+      m_Samples(),
+      m_Window( window ),
+      m_Next( 0 ),
+      m_Count( 0 ),
+      m_Lock()
+{
+    m_Samples.reserve( m_Window );
+}
+
+void LatencyStats::Add( int64_t latency_ns )
+{
+    std::lock_guard<std::mutex> guard( m_Lock );
+
+    if( m_Samples.size() < m_Window ){
+        m_Samples.push_back( latency_ns );
+    }
+    else {
+        m_Samples[m_Next] = latency_ns;
+    }
+    m_Next = (m_Next + 1) % m_Window;
+    ++m_Count;
+}
+
+LatencyStats::Summary LatencyStats::GetSummary() const
+{
+    std::vector<int64_t> samples;
+    uint64_t count = 0;
+    {
+        std::lock_guard<std::mutex> guard( m_Lock );
+        samples = m_Samples;
+        count = m_Count;
+    }
+
+    return Summarize( std::move( samples ), count );
+}
+
+LatencyStats::Summary LatencyStats::Summarize( std::vector<int64_t> samples, uint64_t count )
+{
+    Summary summary = { count, 0.0, 0.0, 0.0, 0.0 };
+    if( samples.empty() ){
+        return summary;
+    }
+
+    std::sort( samples.begin(), samples.end() );
+    auto percentile = [&samples]( double p ){
+        size_t index = static_cast<size_t>( p * (samples.size() - 1) + 0.5 );
+        return NsToMs( samples[index] );
+    };
+    summary.P50Ms = percentile( 0.50 );
+    summary.P90Ms = percentile( 0.90 );
+    summary.P99Ms = percentile( 0.99 );
+    summary.MaxMs = NsToMs( samples.back() );
+
+    return summary;
+}
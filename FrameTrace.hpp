@@ -0,0 +1,102 @@
+#ifndef FRAMETRACE_HPP_INCLUDED
+#define FRAMETRACE_HPP_INCLUDED
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// フレームごとの識別情報。キャプチャ時に採番し、各キュー・スレッドへ引き回す
+struct FrameInfo
+{
+    uint64_t Sequence;          // 0 = 未採番
+    int64_t  CaptureTimeNs;     // CLOCK_MONOTONIC
+};
+
+// 単調増加時刻[ns]。steady_clock は Linux では CLOCK_MONOTONIC。
+int64_t TraceNowNs();
+
+// トレースの表示レーン (Chrome trace の tid)
+enum TraceTrack
+{
+    TRACK_CAPTURE = 1,
+    TRACK_DETECTOR,
+    TRACK_WEB_STREAM_WRITER,
+    TRACK_FACE_RECORDER,
+    TRACK_MAX
+};
+
+// ロックフリーのトレースバッファ
+//
+// 固定長のリングに区間(span)を記録する。Record() は fetch_add で書き込み先を
+// 確保するだけなので、複数スレッドから待ちなしで呼び出せる。
+// 古いイベントは上書きされる。Dump 中に上書きされたイベントは出力しない。
+class FrameTracer
+{
+public:
+
+    static constexpr size_t sk_DefaultCapacity = 16384;
+
+    explicit FrameTracer( size_t capacity = sk_DefaultCapacity );
+    ~FrameTracer() = default;
+    FrameTracer( const FrameTracer& ) = delete;
+    FrameTracer& operator=( const FrameTracer& ) = delete;
+
+    // name は文字列リテラルなど、プロセス終了まで有効なものを渡すこと
+    void Record( const char* name, TraceTrack track, uint64_t sequence, int64_t begin_ns, int64_t end_ns );
+    void DumpChromeTrace( std::ostream& os ) const;
+    // バッファに残っている name の区間長[ns]を取り出す
+    std::vector<int64_t> CollectDurations( const char* name ) const;
+
+private:
+
+    struct Event
+    {
+        std::atomic<uint64_t> Commit;   // 書き込み完了時に (書き込み位置 + 1)
+        const char* Name;
+        TraceTrack  Track;
+        uint64_t    Sequence;
+        int64_t     BeginNs;
+        int64_t     EndNs;
+    };
+
+    std::unique_ptr<Event[]> m_Events;
+    size_t                   m_Capacity;
+    std::atomic<uint64_t>    m_Next;
+};
+
+// 直近のレイテンシ標本からパーセンタイルを求める
+class LatencyStats
+{
+public:
+
+    static constexpr size_t sk_DefaultWindow = 1024;
+
+    struct Summary
+    {
+        uint64_t Count;
+        double   P50Ms;
+        double   P90Ms;
+        double   P99Ms;
+        double   MaxMs;
+    };
+
+    explicit LatencyStats( size_t window = sk_DefaultWindow );
+
+    void Add( int64_t latency_ns );
+    Summary GetSummary() const;
+
+    static Summary Summarize( std::vector<int64_t> samples_ns, uint64_t count );
+
+private:
+
+    std::vector<int64_t> m_Samples;
+    size_t               m_Window;
+    size_t               m_Next;
+    uint64_t             m_Count;
+    mutable std::mutex   m_Lock;
+};
+
+#endif  // FRAMETRACE_HPP_INCLUDED
@@ -0,0 +1,450 @@
+
+#include "MjpegHttpServer.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr int    sk_MaxEpollEvents   = 32;
+constexpr int    sk_EpollTimeoutMs   = 100;
+constexpr size_t sk_MaxRequestLength = 8192;
+
+const char sk_StreamResponseHeader[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Cache-Control: no-cache, no-store, must-revalidate\r\n"
+    "Pragma: no-cache\r\n"
+    "Connection: close\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+    "\r\n";
+
+const char sk_BusyResponse[] =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+const char sk_BadRequestResponse[] =
+    "HTTP/1.0 400 Bad Request\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+}
+
+constexpr const char* MjpegHttpServer::sk_DefaultBindAddress;
+constexpr int MjpegHttpServer::sk_DefaultMaxClients;
+constexpr int MjpegHttpServer::sk_DefaultJpegQuality;
+constexpr int MjpegHttpServer::sk_RequestTimeoutMs;
+
+MjpegHttpServer::MjpegHttpServer()
+    :
+      m_Setting(),
+      m_ListenFd( -1 ),
+      m_EpollFd( -1 ),
+      m_WakeFd( -1 ),
+      m_ServerThread(),
+      m_IsRunning( false ),
+      m_StreamingClientCount( 0 ),
+      m_Clients(),
+      m_PendingImage(),
+      m_PendingLock()
+{}
+
+MjpegHttpServer::~MjpegHttpServer()
+{
+    Close();
+}
+
+bool MjpegHttpServer::Open( const MjpegHttpServer::Setting& setting )
+{
+    if( m_IsRunning.load() ){
+        return false;
+    }
+
+    m_Setting = setting;
+
+    m_ListenFd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( m_ListenFd < 0 ){
+        std::cerr << "MjpegHttpServer: socket failed. " << std::strerror(errno) << std::endl;
+        Close();
+        return false;
+    }
+
+    int reuse = 1;
+    setsockopt( m_ListenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse) );
+
+    const std::string bind_address = m_Setting.BindAddress.empty() ? sk_DefaultBindAddress : m_Setting.BindAddress;
+    sockaddr_in addr;
+    std::memset( &addr, 0, sizeof(addr) );
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons( m_Setting.Port );
+    if( inet_pton( AF_INET, bind_address.c_str(), &addr.sin_addr ) != 1 ){
+        std::cerr << "MjpegHttpServer: invalid bind address. " << bind_address << std::endl;
+        Close();
+        return false;
+    }
+    if( bind( m_ListenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr) ) != 0 ||
+        listen( m_ListenFd, SOMAXCONN ) != 0 )
+    {
+        std::cerr << "MjpegHttpServer: bind/listen failed. " << std::strerror(errno) << std::endl;
+        Close();
+        return false;
+    }
+
+    m_EpollFd = epoll_create1( EPOLL_CLOEXEC );
+    m_WakeFd  = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if( m_EpollFd < 0 || m_WakeFd < 0 ){
+        std::cerr << "MjpegHttpServer: epoll/eventfd failed. " << std::strerror(errno) << std::endl;
+        Close();
+        return false;
+    }
+
+    epoll_event ev;
+    std::memset( &ev, 0, sizeof(ev) );
+    ev.events  = EPOLLIN;
+    ev.data.fd = m_ListenFd;
+    epoll_ctl( m_EpollFd, EPOLL_CTL_ADD, m_ListenFd, &ev );
+    ev.data.fd = m_WakeFd;
+    epoll_ctl( m_EpollFd, EPOLL_CTL_ADD, m_WakeFd, &ev );
+
+    try {
+        m_IsRunning.store( true );
+        m_ServerThread = std::make_unique<std::thread>( &MjpegHttpServer::ServerThread, this );
+    }
+    catch( std::system_error& e ){
+        std::cerr << e.what() << std::endl;
+        m_IsRunning.store( false );
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+void MjpegHttpServer::Publish( const cv::Mat& image )
+{
+    // 視聴者がいないときはコピーもエンコードもしない
+    if( !m_IsRunning.load() || m_StreamingClientCount.load() == 0 || image.empty() ){
+        return;
+    }
+
+    {
+        // 呼び出し元は渡した画像に顔検出結果を描画することがあるので、ここで複製しておく
+        // エンコードが追いつかない場合は古いフレームを上書きする
+        std::lock_guard<std::mutex> guard( m_PendingLock );
+        image.copyTo( m_PendingImage );
+    }
+
+    uint64_t one = 1;
+    ssize_t ret = write( m_WakeFd, &one, sizeof(one) );
+    (void)ret;
+}
+
+void MjpegHttpServer::Close()
+{
+    m_IsRunning.store( false );
+    if( m_ServerThread.get() && m_ServerThread->joinable() ){
+        m_ServerThread->join();
+    }
+    m_ServerThread.reset();
+
+    for( auto& client : m_Clients ){
+        close( client.first );
+    }
+    m_Clients.clear();
+    m_StreamingClientCount.store( 0 );
+
+    if( m_WakeFd >= 0 ){
+        close( m_WakeFd );
+        m_WakeFd = -1;
+    }
+    if( m_EpollFd >= 0 ){
+        close( m_EpollFd );
+        m_EpollFd = -1;
+    }
+    if( m_ListenFd >= 0 ){
+        close( m_ListenFd );
+        m_ListenFd = -1;
+    }
+}
+
+int MjpegHttpServer::ClientCount() const
+{
+    return m_StreamingClientCount.load();
+}
+
+void MjpegHttpServer::ServerThread()
+{
+    epoll_event events[sk_MaxEpollEvents];
+
+    while( m_IsRunning.load() )
+    {
+        int count = epoll_wait( m_EpollFd, events, sk_MaxEpollEvents, sk_EpollTimeoutMs );
+        if( count < 0 ){
+            if( errno == EINTR ){
+                continue;
+            }
+            std::cerr << "MjpegHttpServer: epoll_wait failed. " << std::strerror(errno) << std::endl;
+            break;
+        }
+
+        for( int i = 0; i < count; ++i ){
+            const int fd = events[i].data.fd;
+
+            if( fd == m_ListenFd ){
+                AcceptClients();
+                continue;
+            }
+            if( fd == m_WakeFd ){
+                uint64_t value;
+                while( read( m_WakeFd, &value, sizeof(value) ) > 0 ){}
+                BroadcastLatestFrame();
+                continue;
+            }
+
+            auto it = m_Clients.find( fd );
+            if( it == m_Clients.end() ){
+                continue;
+            }
+            if( events[i].events & (EPOLLERR | EPOLLHUP) ){
+                CloseClient( fd );
+                continue;
+            }
+            if( events[i].events & EPOLLIN ){
+                ReadClient( it->second );
+                if( m_Clients.find( fd ) == m_Clients.end() ){
+                    continue;
+                }
+            }
+            if( events[i].events & EPOLLOUT ){
+                if( !FlushClient( it->second ) ){
+                    CloseClient( fd );
+                }
+            }
+        }
+
+        CloseExpiredClients();
+    }
+}
+
+void MjpegHttpServer::AcceptClients()
+{
+    while( true )
+    {
+        int fd = accept4( m_ListenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC );
+        if( fd < 0 ){
+            // EAGAIN: 受け付け待ちの接続がなくなった
+            return;
+        }
+
+        if( static_cast<int>(m_Clients.size()) >= m_Setting.MaxClients ){
+            ssize_t ret = send( fd, sk_BusyResponse, sizeof(sk_BusyResponse) - 1, MSG_NOSIGNAL );
+            (void)ret;
+            close( fd );
+            continue;
+        }
+
+        epoll_event ev;
+        std::memset( &ev, 0, sizeof(ev) );
+        ev.events  = EPOLLIN;
+        ev.data.fd = fd;
+        if( epoll_ctl( m_EpollFd, EPOLL_CTL_ADD, fd, &ev ) != 0 ){
+            close( fd );
+            continue;
+        }
+
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds( sk_RequestTimeoutMs );
+        Client client = { fd, false, false, std::string(), nullptr, 0, nullptr, deadline };
+        m_Clients.emplace( fd, client );
+    }
+}
+
+void MjpegHttpServer::ReadClient( Client& client )
+{
+    char buf[1024];
+
+    while( true )
+    {
+        ssize_t size = recv( client.Fd, buf, sizeof(buf), 0 );
+        if( size == 0 ){
+            CloseClient( client.Fd );
+            return;
+        }
+        if( size < 0 ){
+            if( errno == EAGAIN || errno == EWOULDBLOCK ){
+                break;
+            }
+            CloseClient( client.Fd );
+            return;
+        }
+        // 配信開始後にクライアントから送られてくるデータは読み捨てる
+        if( !client.IsStreaming ){
+            client.Request.append( buf, size );
+        }
+    }
+
+    if( client.IsStreaming ){
+        return;
+    }
+    if( client.Request.find( "\r\n\r\n" ) == std::string::npos ){
+        if( client.Request.size() > sk_MaxRequestLength ){
+            CloseClient( client.Fd );
+        }
+        return;
+    }
+
+    // パスは見ずに、GET であれば常にストリームを返す
+    if( client.Request.compare( 0, 4, "GET " ) != 0 ){
+        ssize_t ret = send( client.Fd, sk_BadRequestResponse, sizeof(sk_BadRequestResponse) - 1, MSG_NOSIGNAL );
+        (void)ret;
+        CloseClient( client.Fd );
+        return;
+    }
+
+    client.Request.clear();
+    client.IsStreaming = true;
+    client.Sending     = std::make_shared<const Buffer>( sk_StreamResponseHeader, sk_StreamResponseHeader + sizeof(sk_StreamResponseHeader) - 1 );
+    client.SendOffset  = 0;
+    ++m_StreamingClientCount;
+
+    if( !FlushClient( client ) ){
+        CloseClient( client.Fd );
+    }
+}
+
+bool MjpegHttpServer::FlushClient( Client& client )
+{
+    while( true )
+    {
+        if( !client.Sending ){
+            if( !client.Pending ){
+                SetWaitWritable( client, false );
+                return true;
+            }
+            client.Sending    = std::move( client.Pending );
+            client.SendOffset = 0;
+            client.Pending.reset();
+        }
+
+        const Buffer& buf = *client.Sending;
+        ssize_t size = send( client.Fd, buf.data() + client.SendOffset, buf.size() - client.SendOffset, MSG_NOSIGNAL );
+        if( size < 0 ){
+            if( errno == EAGAIN || errno == EWOULDBLOCK ){
+                SetWaitWritable( client, true );
+                return true;
+            }
+            return false;
+        }
+
+        client.SendOffset += size;
+        if( client.SendOffset >= buf.size() ){
+            client.Sending.reset();
+        }
+    }
+}
+
+void MjpegHttpServer::CloseClient( int fd )
+{
+    auto it = m_Clients.find( fd );
+    if( it == m_Clients.end() ){
+        return;
+    }
+    if( it->second.IsStreaming ){
+        --m_StreamingClientCount;
+    }
+    epoll_ctl( m_EpollFd, EPOLL_CTL_DEL, fd, nullptr );
+    close( fd );
+    m_Clients.erase( it );
+}
+
+// リクエストヘッダを送ってこないまま接続枠を占有しているクライアントを切断する
+void MjpegHttpServer::CloseExpiredClients()
+{
+    const auto now = std::chrono::steady_clock::now();
+
+    std::vector<int> expired_clients;
+    for( auto& it : m_Clients ){
+        if( !it.second.IsStreaming && now >= it.second.RequestDeadline ){
+            expired_clients.push_back( it.first );
+        }
+    }
+    for( int fd : expired_clients ){
+        CloseClient( fd );
+    }
+}
+
+void MjpegHttpServer::BroadcastLatestFrame()
+{
+    cv::Mat image;
+    {
+        std::lock_guard<std::mutex> guard( m_PendingLock );
+        image = m_PendingImage;
+        m_PendingImage = cv::Mat();
+    }
+    if( image.empty() || m_StreamingClientCount.load() == 0 ){
+        return;
+    }
+
+    std::vector<uint8_t> jpeg;
+    try {
+        if( !cv::imencode( ".jpg", image, jpeg, { cv::IMWRITE_JPEG_QUALITY, m_Setting.JpegQuality } ) ){
+            return;
+        }
+    }
+    catch( cv::Exception& e ){
+        std::cerr << e.what() << std::endl;
+        return;
+    }
+
+    // multipart のパートヘッダと JPEG をひとつのバッファにまとめ、全クライアントで共有する
+    std::string part_header =
+        "--frame\r\n"
+        "Content-Type: image/jpeg\r\n"
+        "Content-Length: " + std::to_string( jpeg.size() ) + "\r\n"
+        "\r\n";
+    auto part = std::make_shared<Buffer>();
+    part->reserve( part_header.size() + jpeg.size() + 2 );
+    part->insert( part->end(), part_header.begin(), part_header.end() );
+    part->insert( part->end(), jpeg.begin(), jpeg.end() );
+    part->push_back( '\r' );
+    part->push_back( '\n' );
+    std::shared_ptr<const Buffer> frame = part;
+
+    std::vector<int> error_clients;
+    for( auto& it : m_Clients ){
+        Client& client = it.second;
+        if( !client.IsStreaming ){
+            continue;
+        }
+        // 送信中のフレームが残っているクライアントは、未送信の古いフレームを捨てて最新だけを保持する
+        client.Pending = frame;
+        if( !client.IsWaitingWritable && !FlushClient( client ) ){
+            error_clients.push_back( client.Fd );
+        }
+    }
+    for( int fd : error_clients ){
+        CloseClient( fd );
+    }
+}
+
+void MjpegHttpServer::SetWaitWritable( Client& client, bool wait )
+{
+    if( client.IsWaitingWritable == wait ){
+        return;
+    }
+
+    epoll_event ev;
+    std::memset( &ev, 0, sizeof(ev) );
+    ev.events  = wait ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.fd = client.Fd;
+    epoll_ctl( m_EpollFd, EPOLL_CTL_MOD, client.Fd, &ev );
+    client.IsWaitingWritable = wait;
+}
@@ -0,0 +1,91 @@
+#ifndef MJPEG_HTTP_SERVER_HPP_INCLUDED
+#define MJPEG_HTTP_SERVER_HPP_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// multipart/x-mixed-replace で MJPEG を配信する簡易 HTTP サーバ
+//
+// JPEG エンコードはフレームごとに最大 1 回だけ行い、エンコード結果は
+// shared_ptr で全クライアントに共有する。送信が追いつかないクライアントは
+// 未送信のフレームを捨てて最新フレームだけを送る。
+// 動作確認: curl -s http://127.0.0.1:8080/ -o stream.mjpeg
+class MjpegHttpServer
+{
+public:
+
+    struct Setting
+    {
+        // 待ち受けアドレス。空なら sk_DefaultBindAddress (ループバックのみ)。
+        // 認証は無いので、外部に公開する場合は明示的に指定すること
+        std::string BindAddress;
+        uint16_t Port;
+        int      MaxClients;
+        int      JpegQuality;
+    };
+
+    static constexpr const char* sk_DefaultBindAddress = "127.0.0.1";
+    static constexpr int sk_DefaultMaxClients  = 8;
+    static constexpr int sk_DefaultJpegQuality = 80;
+    // リクエストヘッダを受け取り終えるまでの猶予。過ぎたら切断する
+    static constexpr int sk_RequestTimeoutMs   = 5000;
+
+    MjpegHttpServer();
+    ~MjpegHttpServer();
+    MjpegHttpServer( const MjpegHttpServer& ) = delete;
+    MjpegHttpServer& operator=( const MjpegHttpServer& ) = delete;
+
+    bool Open( const MjpegHttpServer::Setting& setting );
+    void Publish( const cv::Mat& image );
+    void Close();
+    int ClientCount() const;
+
+private:
+
+    typedef std::vector<uint8_t> Buffer;
+
+    struct Client
+    {
+        int                           Fd;
+        bool                          IsStreaming;
+        bool                          IsWaitingWritable;
+        std::string                   Request;
+        std::shared_ptr<const Buffer> Sending;
+        size_t                        SendOffset;
+        std::shared_ptr<const Buffer> Pending;
+        std::chrono::steady_clock::time_point RequestDeadline;
+    };
+
+    void ServerThread();
+    void AcceptClients();
+    void ReadClient( Client& client );
+    bool FlushClient( Client& client );
+    void CloseClient( int fd );
+    void CloseExpiredClients();
+    void BroadcastLatestFrame();
+    void SetWaitWritable( Client& client, bool wait );
+
+    MjpegHttpServer::Setting     m_Setting;
+    int                          m_ListenFd;
+    int                          m_EpollFd;
+    int                          m_WakeFd;
+    std::unique_ptr<std::thread> m_ServerThread;
+    std::atomic<bool>            m_IsRunning;
+    std::atomic<int>             m_StreamingClientCount;
+
+    // サーバスレッドのみが触る
+    std::map<int, Client> m_Clients;
+
+    cv::Mat    m_PendingImage;
+    std::mutex m_PendingLock;
+};
+
+#endif  // MJPEG_HTTP_SERVER_HPP_INCLUDED
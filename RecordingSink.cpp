@@ -0,0 +1,347 @@
+
+#include "RecordingSink.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+double ElapsedMilli( std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end )
+{
+    return std::chrono::duration<double, std::milli>( end - begin ).count();
+}
+
+}
+
+RecordingSink::RecordingSink()
+    :
+      m_Setting(),
+      m_FileFd( -1 ),
+      m_PipeReadFd( -1 ),
+      m_PipeWriteFd( -1 ),
+      m_ReaderThread(),
+      m_WriterThread(),
+      m_WriteQueue(),
+      m_FreeChunks(),
+      m_IsReadFinished( false ),
+      m_QueueLock(),
+      m_QueueCond(),
+      m_FileOffset( 0 ),
+      m_AllocatedBytes( 0 ),
+      m_BytesSinceFsync( 0 ),
+      m_Metrics( RecordingSink::Metrics() ),
+      m_IsError( false )
+{}
+
+RecordingSink::~RecordingSink()
+{
+    Close();
+
+    for( Chunk& chunk : m_FreeChunks ){
+        std::free( chunk.Data );
+    }
+    for( Chunk& chunk : m_WriteQueue ){
+        std::free( chunk.Data );
+    }
+}
+
+bool RecordingSink::Open( const RecordingSink::Setting& setting )
+{
+    if( m_FileFd >= 0 ){
+        return false;
+    }
+
+    m_Setting = setting;
+
+    m_FileFd = open( m_Setting.Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if( m_FileFd < 0 ){
+        std::cerr << "RecordingSink: open failed. " << m_Setting.Path << " " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    int fds[2];
+    if( pipe2( fds, O_CLOEXEC ) != 0 ){
+        std::cerr << "RecordingSink: pipe failed. " << std::strerror(errno) << std::endl;
+        close( m_FileFd );
+        m_FileFd = -1;
+        return false;
+    }
+    m_PipeReadFd  = fds[0];
+    m_PipeWriteFd = fds[1];
+    // エンコーダが小刻みに待たされないよう、パイプのバッファを 1 チャンク分に広げる
+    fcntl( m_PipeWriteFd, F_SETPIPE_SZ, static_cast<int>(sk_ChunkBytes) );
+
+    Preallocate( m_Setting.PreallocateBytes );
+
+    try {
+        m_ReaderThread = std::make_unique<std::thread>( &RecordingSink::ReaderThread, this );
+        m_WriterThread = std::make_unique<std::thread>( &RecordingSink::WriterThread, this );
+    }
+    catch( std::system_error& e ){
+        std::cerr << e.what() << std::endl;
+        m_IsError.Set( true );
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+int RecordingSink::GetInputFd() const
+{
+    return m_PipeWriteFd;
+}
+
+void RecordingSink::Close()
+{
+    // 書き込み側を閉じると、読み出しスレッドは残りを読み切ったあと EOF で終了する
+    if( m_PipeWriteFd >= 0 ){
+        close( m_PipeWriteFd );
+        m_PipeWriteFd = -1;
+    }
+    if( m_ReaderThread.get() && m_ReaderThread->joinable() ){
+        m_ReaderThread->join();
+    }
+    {
+        std::lock_guard<std::mutex> guard( m_QueueLock );
+        m_IsReadFinished = true;
+    }
+    m_QueueCond.notify_all();
+    if( m_WriterThread.get() && m_WriterThread->joinable() ){
+        m_WriterThread->join();
+    }
+
+    if( m_PipeReadFd >= 0 ){
+        close( m_PipeReadFd );
+        m_PipeReadFd = -1;
+    }
+    if( m_FileFd >= 0 ){
+        close( m_FileFd );
+        m_FileFd = -1;
+    }
+}
+
+bool RecordingSink::IsError() const
+{
+    return m_IsError.Get();
+}
+
+RecordingSink::Metrics RecordingSink::GetMetrics() const
+{
+    return m_Metrics.Get();
+}
+
+void RecordingSink::ReaderThread()
+{
+    Chunk chunk = { nullptr, 0 };
+    try {
+        {
+            std::lock_guard<std::mutex> guard( m_QueueLock );
+            chunk = AllocateChunk();
+        }
+        ReadPipe( chunk );
+    }
+    // 例外をすべてキャッチして、今後の書き込みを禁止する。
+    // 例外をキャッチしないと親スレッドごと落ちてしまうため。
+    catch( ... ){
+        std::cerr << "RecordingSink reader thread aborted." << std::endl;
+        m_IsError.Set( true );
+    }
+
+    {
+        std::lock_guard<std::mutex> guard( m_QueueLock );
+        if( chunk.Data != nullptr && chunk.Size > 0 ){
+            m_WriteQueue.push_back( chunk );
+        }
+        else if( chunk.Data != nullptr ){
+            ReleaseChunk( chunk );
+        }
+        m_IsReadFinished = true;
+    }
+    m_QueueCond.notify_all();
+}
+
+void RecordingSink::ReadPipe( Chunk& chunk )
+{
+    while( true )
+    {
+        ssize_t size = read( m_PipeReadFd, chunk.Data + chunk.Size, sk_ChunkBytes - chunk.Size );
+        if( size < 0 ){
+            if( errno == EINTR ){
+                continue;
+            }
+            std::cerr << "RecordingSink: read failed. " << std::strerror(errno) << std::endl;
+            m_IsError.Set( true );
+            break;
+        }
+        if( size == 0 ){
+            break;
+        }
+
+        chunk.Size += size;
+        if( chunk.Size < sk_ChunkBytes ){
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock( m_QueueLock );
+        m_QueueCond.wait( lock, [this]{ return m_WriteQueue.size() < sk_MaxQueuedChunks; } );
+        m_WriteQueue.push_back( chunk );
+        chunk = { nullptr, 0 };
+        chunk = AllocateChunk();
+
+        {
+            // 書き込みスレッドも更新するので、Get/Set ではなくロックしたまま更新する
+            std::lock_guard<std::mutex> guard( m_Metrics.Mutex );
+            m_Metrics.Value.MaxQueuedChunks = std::max<uint64_t>( m_Metrics.Value.MaxQueuedChunks, m_WriteQueue.size() );
+        }
+
+        lock.unlock();
+        m_QueueCond.notify_all();
+    }
+}
+
+void RecordingSink::WriterThread()
+{
+    while( true )
+    {
+        Chunk chunk;
+        {
+            std::unique_lock<std::mutex> lock( m_QueueLock );
+            m_QueueCond.wait( lock, [this]{ return !m_WriteQueue.empty() || m_IsReadFinished; } );
+            if( m_WriteQueue.empty() ){
+                break;
+            }
+            chunk = m_WriteQueue.front();
+            m_WriteQueue.pop_front();
+        }
+
+        // 一度エラーになったら以降は読み捨て、エンコーダを止めないことを優先する
+        if( !m_IsError.Get() && !WriteChunk( chunk ) ){
+            m_IsError.Set( true );
+        }
+
+        {
+            std::lock_guard<std::mutex> guard( m_QueueLock );
+            ReleaseChunk( chunk );
+        }
+        m_QueueCond.notify_all();
+    }
+
+    // KEEP_SIZE で確保したブロックはファイルサイズには現れないが、閉じても解放されない。
+    // 書き込んだ分まで切り詰めて、末尾の未使用ブロックを返す
+    if( m_FileFd >= 0 && m_AllocatedBytes > m_FileOffset ){
+        if( ftruncate( m_FileFd, static_cast<off_t>(m_FileOffset) ) != 0 ){
+            std::cerr << "RecordingSink: ftruncate failed. " << std::strerror(errno) << std::endl;
+        }
+        m_AllocatedBytes = m_FileOffset;
+    }
+
+    if( m_Setting.Fsync != FSYNC_NONE && m_FileFd >= 0 ){
+        auto begin = std::chrono::steady_clock::now();
+        fsync( m_FileFd );
+        double latency = ElapsedMilli( begin, std::chrono::steady_clock::now() );
+
+        std::lock_guard<std::mutex> guard( m_Metrics.Mutex );
+        ++m_Metrics.Value.FsyncCount;
+        m_Metrics.Value.FsyncLatencyMaxMs = std::max( m_Metrics.Value.FsyncLatencyMaxMs, latency );
+    }
+}
+
+bool RecordingSink::WriteChunk( const Chunk& chunk )
+{
+    Preallocate( m_FileOffset + chunk.Size );
+
+    auto begin = std::chrono::steady_clock::now();
+    size_t written = 0;
+    while( written < chunk.Size )
+    {
+        ssize_t size = pwrite( m_FileFd, chunk.Data + written, chunk.Size - written, static_cast<off_t>(m_FileOffset + written) );
+        if( size < 0 ){
+            if( errno == EINTR ){
+                continue;
+            }
+            std::cerr << "RecordingSink: write failed. " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        written += size;
+    }
+    double latency = ElapsedMilli( begin, std::chrono::steady_clock::now() );
+
+    m_FileOffset      += chunk.Size;
+    m_BytesSinceFsync += chunk.Size;
+
+    double fsync_latency = -1.0;
+    if( m_Setting.Fsync == FSYNC_INTERVAL && m_BytesSinceFsync >= m_Setting.FsyncIntervalBytes ){
+        auto fsync_begin = std::chrono::steady_clock::now();
+        fdatasync( m_FileFd );
+        fsync_latency = ElapsedMilli( fsync_begin, std::chrono::steady_clock::now() );
+        m_BytesSinceFsync = 0;
+    }
+
+    // 読み出しスレッドも更新するので、ロックしたまま更新する
+    std::lock_guard<std::mutex> guard( m_Metrics.Mutex );
+    Metrics& metrics = m_Metrics.Value;
+    metrics.BytesWritten += chunk.Size;
+    metrics.WriteLatencyAvgMs = (metrics.WriteLatencyAvgMs * metrics.WriteCount + latency) / (metrics.WriteCount + 1);
+    metrics.WriteLatencyMaxMs = std::max( metrics.WriteLatencyMaxMs, latency );
+    ++metrics.WriteCount;
+    if( fsync_latency >= 0.0 ){
+        ++metrics.FsyncCount;
+        metrics.FsyncLatencyMaxMs = std::max( metrics.FsyncLatencyMaxMs, fsync_latency );
+    }
+
+    return true;
+}
+
+bool RecordingSink::Preallocate( uint64_t required_bytes )
+{
+    if( required_bytes <= m_AllocatedBytes || m_Setting.PreallocateBytes == 0 ){
+        return true;
+    }
+
+    const uint64_t unit = m_Setting.PreallocateBytes;
+    const uint64_t new_size = ((required_bytes + unit - 1) / unit) * unit;
+
+    // ファイルサイズは変えずにブロックだけ確保する
+    // 対応していないファイルシステムでは通常の書き込みにまかせる
+    if( fallocate( m_FileFd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(m_AllocatedBytes), static_cast<off_t>(new_size - m_AllocatedBytes) ) != 0 ){
+        if( errno != EOPNOTSUPP ){
+            std::cerr << "RecordingSink: fallocate failed. " << std::strerror(errno) << std::endl;
+        }
+        m_Setting.PreallocateBytes = 0;
+        return false;
+    }
+    m_AllocatedBytes = new_size;
+
+    return true;
+}
+
+RecordingSink::Chunk RecordingSink::AllocateChunk()
+{
+    if( !m_FreeChunks.empty() ){
+        Chunk chunk = m_FreeChunks.back();
+        m_FreeChunks.pop_back();
+        chunk.Size = 0;
+        return chunk;
+    }
+
+    // ページキャッシュ経由で書くので、バッファのアラインメントは気にしなくてよい
+    void* data = std::malloc( sk_ChunkBytes );
+    if( data == nullptr ){
+        throw std::bad_alloc();
+    }
+    return { static_cast<uint8_t*>(data), 0 };
+}
+
+void RecordingSink::ReleaseChunk( Chunk& chunk )
+{
+    chunk.Size = 0;
+    m_FreeChunks.push_back( chunk );
+}
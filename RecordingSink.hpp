@@ -0,0 +1,109 @@
+#ifndef RECORDINGSINK_HPP_INCLUDED
+#define RECORDINGSINK_HPP_INCLUDED
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Mutex.hpp"
+
+// 録画ファイルへのディスク I/O をエンコーダから切り離すための書き込み段
+//
+// エンコーダ(GStreamer の fdsink)はパイプに書き込み、読み出しスレッドが
+// それを大きなチャンクにまとめて書き込みキューに積む。
+// 書き込みスレッドは fallocate で事前確保したファイルへチャンク単位で書き込む。
+// ディスクが一時的に詰まってもキューが溢れるまではエンコーダは待たされない。
+class RecordingSink
+{
+public:
+
+    enum FsyncPolicy
+    {
+        FSYNC_NONE,         // OS に任せる
+        FSYNC_ON_CLOSE,     // Close() 時に 1 回
+        FSYNC_INTERVAL      // FsyncIntervalBytes 書き込むごと
+    };
+
+    struct Setting
+    {
+        std::string Path;
+        uint64_t    PreallocateBytes;   // fallocate で確保する単位
+        FsyncPolicy Fsync;
+        uint64_t    FsyncIntervalBytes;
+    };
+
+    struct Metrics
+    {
+        uint64_t BytesWritten;
+        uint64_t WriteCount;
+        double   WriteLatencyAvgMs;
+        double   WriteLatencyMaxMs;
+        uint64_t FsyncCount;
+        double   FsyncLatencyMaxMs;
+        uint64_t MaxQueuedChunks;
+    };
+
+    static constexpr size_t   sk_ChunkBytes        = 1024 * 1024;
+    // これ以上溜まった場合はパイプの読み出しを止める(エンコーダ側が待たされる)
+    static constexpr size_t   sk_MaxQueuedChunks   = 64;
+    static constexpr uint64_t sk_DefaultPreallocateBytes = 256ull * 1024 * 1024;
+
+    RecordingSink();
+    ~RecordingSink();
+    RecordingSink( const RecordingSink& ) = delete;
+    RecordingSink& operator=( const RecordingSink& ) = delete;
+
+    bool Open( const RecordingSink::Setting& setting );
+    // エンコーダに渡すパイプの書き込み側
+    int GetInputFd() const;
+    // エンコーダを止めてから呼ぶこと。キューに残ったデータをすべて書き込んでから閉じる
+    void Close();
+    bool IsError() const;
+    Metrics GetMetrics() const;
+
+private:
+
+    struct Chunk
+    {
+        uint8_t* Data;
+        size_t   Size;
+    };
+
+    void ReaderThread();
+    void ReadPipe( Chunk& chunk );
+    void WriterThread();
+    bool WriteChunk( const Chunk& chunk );
+    bool Preallocate( uint64_t required_bytes );
+    Chunk AllocateChunk();
+    void ReleaseChunk( Chunk& chunk );
+
+    RecordingSink::Setting m_Setting;
+    int m_FileFd;
+    int m_PipeReadFd;
+    int m_PipeWriteFd;
+
+    std::unique_ptr<std::thread> m_ReaderThread;
+    std::unique_ptr<std::thread> m_WriterThread;
+
+    // 読み出しスレッド -> 書き込みスレッド
+    std::deque<Chunk>       m_WriteQueue;
+    std::vector<Chunk>      m_FreeChunks;
+    bool                    m_IsReadFinished;
+    std::mutex              m_QueueLock;
+    std::condition_variable m_QueueCond;
+
+    // 書き込みスレッドのみが触る
+    uint64_t m_FileOffset;
+    uint64_t m_AllocatedBytes;
+    uint64_t m_BytesSinceFsync;
+
+    MutexGuard<Metrics> m_Metrics;
+    MutexGuard<bool>    m_IsError;
+};
+
+#endif  // RECORDINGSINK_HPP_INCLUDED
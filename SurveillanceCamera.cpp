@@ -1,6 +1,9 @@
 
 #include "SurveillanceCamera.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #include <iomanip>
 #include <sstream>
 #include <iostream>
@@ -26,6 +29,24 @@ std::string BuildTimeStampString() {
     return s.str();
 }
 
+// RFC 4180 に従って CSV のフィールドを書き出す。区切り文字・引用符・改行を含む場合だけ引用符で囲む
+std::string QuoteCsvField( const std::string& field )
+{
+    if( field.find_first_of( ",\"\r\n" ) == std::string::npos ){
+        return field;
+    }
+
+    std::string quoted = "\"";
+    for( char c : field ){
+        if( c == '"' ){
+            quoted += '"';
+        }
+        quoted += c;
+    }
+    quoted += '"';
+    return quoted;
+}
+
 void PrintDetectState( FaceDetector::State state )
 {
     switch( state ){
@@ -64,7 +85,14 @@ FaceDetector::FaceDetector()
       m_FaceDetector(),
       m_FaceDetectThread(),
       m_Image(),
+      m_SourceImage(),
+      m_DetectInput(),
+      m_Preprocessor(),
       m_Faces(),
+      m_FrameInfo(),
+      m_Tracer(),
+      m_Recognizer(),
+      m_Recognitions(),
       m_State( FaceDetector::IDLE )
 {}
 
@@ -98,10 +126,53 @@ bool FaceDetector::Open( const FaceDetector::Setting& setting )
         return false;
     }
 
+    // 顔認識はおまけ機能なので、開けなくても顔検出は続ける
+    if( !m_Setting.RecognitionModelPath.empty() ){
+        if( !m_Recognizer.Open( { m_Setting.RecognitionModelPath, m_Setting.FaceIndexPath } ) ){
+            std::cerr << "Failed open face recognizer. Continue without it." << std::endl;
+        }
+    }
+
+    return true;
+}
+
+bool FaceDetector::WarmUp()
+{
+    if( m_State.Get() != FaceDetector::OPENED ){
+        return false;
+    }
+
+    // 初回の detect() ではネットワークの構築やメモリ確保が走るため、
+    // ダミー画像で一度推論しておき、最初の顔検出が遅れないようにする。
+    // 最後に本来の入力サイズで推論し、実運用時に再構築が起きないようにする。
+    std::vector<cv::Size> sizes = m_Setting.WarmUpSizes;
+    sizes.push_back( { static_cast<int>(m_Setting.Width), static_cast<int>(m_Setting.Height) } );
+
+    try {
+        for( const cv::Size& size : sizes ){
+            cv::Mat dummy( size, CV_8UC3 );
+            cv::Mat faces;
+            cv::randu( dummy, cv::Scalar::all(0), cv::Scalar::all(255) );
+
+            m_FaceDetector->setInputSize( size );
+            m_FaceDetector->detect( dummy, faces );
+        }
+    }
+    catch( cv::Exception& e ){
+        std::cerr << e.what() << std::endl;
+        m_State.Set( FaceDetector::ERROR_FAIL_INITIALIZE );
+        return false;
+    }
+
+    // 顔認識も同様に、最初に認識する顔で待たされないようにする
+    if( m_Recognizer.IsOpened() && !m_Recognizer.WarmUp() ){
+        std::cerr << "Failed warm up face recognizer." << std::endl;
+    }
+
     return true;
 }
 
-FaceDetector::State FaceDetector::Detect( cv::Mat image )
+FaceDetector::State FaceDetector::Detect( cv::Mat image, const FrameInfo& info, cv::Mat source )
 {
     WaitDetectResult();
 
@@ -112,6 +183,8 @@ FaceDetector::State FaceDetector::Detect( cv::Mat image )
 
     try {
         m_Image = image;
+        m_SourceImage = source;
+        m_FrameInfo = info;
         m_State.Value = FaceDetector::FACE_DETECTING;
         m_FaceDetectThread = std::make_unique<std::thread>( &FaceDetector::DetectThread, this );
     }
@@ -148,40 +221,118 @@ cv::Mat FaceDetector::GetFaceDetectVisualizedImage() const
     return m_Image;
 }
 
+cv::Mat FaceDetector::GetFaces() const
+{
+    std::lock_guard<std::mutex> guard( m_State.Mutex );
+
+    if(( m_State.Value != FaceDetector::FACE_DETECT_OK ) &&
+       ( m_State.Value != FaceDetector::FACE_DETECT_NO_FACE ))
+    {
+        return cv::Mat();
+    }
+    return m_Faces.clone();
+}
+
+std::vector<FaceRecognizer::Result> FaceDetector::GetRecognitions() const
+{
+    std::lock_guard<std::mutex> guard( m_State.Mutex );
+
+    if( m_State.Value != FaceDetector::FACE_DETECT_OK ){
+        return std::vector<FaceRecognizer::Result>();
+    }
+    return m_Recognitions;
+}
+
+FrameInfo FaceDetector::GetDetectedFrameInfo() const
+{
+    std::lock_guard<std::mutex> guard( m_State.Mutex );
+    return m_FrameInfo;
+}
+
+void FaceDetector::SetTracer( std::shared_ptr<FrameTracer> tracer )
+{
+    WaitDetectResult();
+    m_Tracer = tracer;
+}
+
 void FaceDetector::DetectThread()
 {
     constexpr int thickness = sk_VisualizeBorderThikness;
 
     try {
-        m_FaceDetector->detect( m_Image, m_Faces );
+        const cv::Size input_size( static_cast<int>(m_Setting.Width), static_cast<int>(m_Setting.Height) );
+
+        int64_t detect_begin = TraceNowNs();
+        if( m_Image.size() == input_size ){
+            m_FaceDetector->detect( m_Image, m_Faces );
+        }
+        else {
+            // 検出器の入力サイズへ縮小してから検出し、座標をキャプチャ画像の座標系へ戻す。
+            // キャプチャが YUYV なら、色変換と縮小を 1 パスで行う
+            const cv::Mat& source = m_SourceImage.empty() ? m_Image : m_SourceImage;
+            m_Preprocessor.Build( source, source.type() == CV_8UC2 ? DETECTOR_INPUT_YUYV : DETECTOR_INPUT_BGR, input_size, m_DetectInput );
+            m_FaceDetector->detect( m_DetectInput, m_Faces );
+
+            const float scale_x = static_cast<float>(m_Image.cols) / input_size.width;
+            const float scale_y = static_cast<float>(m_Image.rows) / input_size.height;
+            for( int i = 0; i < m_Faces.rows; ++i ){
+                float* face = m_Faces.ptr<float>(i);
+                // 0-13 列目は x, y の組 (bbox の x, y, w, h とランドマーク 5 点)
+                for( int j = 0; j < 14; j += 2 ){
+                    face[j]     *= scale_x;
+                    face[j + 1] *= scale_y;
+                }
+            }
+        }
+        if( m_Tracer.get() ){
+            m_Tracer->Record( "detect", TRACK_DETECTOR, m_FrameInfo.Sequence, detect_begin, TraceNowNs() );
+        }
+
+        // 枠を描画する前の画像で顔認識する
+        if( m_Recognizer.IsOpened() ){
+            int64_t recognize_begin = TraceNowNs();
+            m_Recognitions = m_Recognizer.Recognize( m_Image, m_Faces );
+            if( m_Tracer.get() ){
+                m_Tracer->Record( "recognize", TRACK_DETECTOR, m_FrameInfo.Sequence, recognize_begin, TraceNowNs() );
+            }
+        }
 
         for( int i = 0; i < m_Faces.rows; ++i ){
+            const float* face = m_Faces.ptr<float>(i);
+
             // Print results
             std::cout << "Face " << i
-                << ", top-left coordinates: (" << m_Faces.at<float>(i, 0) << ", " << m_Faces.at<float>(i, 1) << "), "
-                << "box width: " << m_Faces.at<float>(i, 2)  << ", box height: " << m_Faces.at<float>(i, 3) << ", "
-                << "score: " << cv::format("%.2f", m_Faces.at<float>(i, 14))
+                << ", top-left coordinates: (" << face[0] << ", " << face[1] << "), "
+                << "box width: " << face[2]  << ", box height: " << face[3] << ", "
+                << "score: " << cv::format("%.2f", face[14])
                 << std::endl;
 
             // Draw bounding box
             cv::rectangle( 
                 m_Image,
                 cv::Rect2i(
-                    static_cast<int>(m_Faces.at<float>(i, 0)), 
-                    static_cast<int>(m_Faces.at<float>(i, 1)), 
-                    static_cast<int>(m_Faces.at<float>(i, 2)), 
-                    static_cast<int>(m_Faces.at<float>(i, 3))
+                    static_cast<int>(face[0]), 
+                    static_cast<int>(face[1]), 
+                    static_cast<int>(face[2]), 
+                    static_cast<int>(face[3])
                 ), 
                 cv::Scalar(0, 255, 0), 
                 thickness
             );
 
             // Draw landmarks
-            cv::circle( m_Image, cv::Point2i(int(m_Faces.at<float>(i, 4)), int(m_Faces.at<float>(i, 5))), 2, cv::Scalar(255, 0, 0), thickness );
-            cv::circle( m_Image, cv::Point2i(int(m_Faces.at<float>(i, 6)), int(m_Faces.at<float>(i, 7))), 2, cv::Scalar(0, 0, 255), thickness );
-            cv::circle( m_Image, cv::Point2i(int(m_Faces.at<float>(i, 8)), int(m_Faces.at<float>(i, 9))), 2, cv::Scalar(0, 255, 0), thickness );
-            cv::circle( m_Image, cv::Point2i(int(m_Faces.at<float>(i, 10)), int(m_Faces.at<float>(i, 11))), 2, cv::Scalar(255, 0, 255), thickness );
-            cv::circle( m_Image, cv::Point2i(int(m_Faces.at<float>(i, 12)), int(m_Faces.at<float>(i, 13))), 2, cv::Scalar(0, 255, 255), thickness );
+            cv::circle( m_Image, cv::Point2i(int(face[4]), int(face[5])), 2, cv::Scalar(255, 0, 0), thickness );
+            cv::circle( m_Image, cv::Point2i(int(face[6]), int(face[7])), 2, cv::Scalar(0, 0, 255), thickness );
+            cv::circle( m_Image, cv::Point2i(int(face[8]), int(face[9])), 2, cv::Scalar(0, 255, 0), thickness );
+            cv::circle( m_Image, cv::Point2i(int(face[10]), int(face[11])), 2, cv::Scalar(255, 0, 255), thickness );
+            cv::circle( m_Image, cv::Point2i(int(face[12]), int(face[13])), 2, cv::Scalar(0, 255, 255), thickness );
+
+            // Draw track id and label
+            if( i < static_cast<int>(m_Recognitions.size()) ){
+                const FaceRecognizer::Result& result = m_Recognitions[i];
+                std::string text = "#" + std::to_string( result.TrackId ) + " " + (result.Label.empty() ? "unknown" : result.Label);
+                cv::putText( m_Image, text, cv::Point2i(int(face[0]), int(face[1]) - 4), cv::FONT_HERSHEY_SIMPLEX, 0.6, cv::Scalar(0, 255, 0), thickness );
+            }
         }
 
         if( m_Faces.rows < 1 ){
@@ -207,7 +358,8 @@ void FaceDetector::DetectThread()
 }
 
 
-ImageWriter::ImageWriter( cv::VideoWriter writer )
+ImageWriter::ImageWriter( cv::VideoWriter writer, TraceTrack track, std::shared_ptr<FrameTracer> tracer,
+                          std::shared_ptr<LatencyStats> latency )
     : 
       m_IsUsed( false ),
       m_ImgWriteThread(),
@@ -215,7 +367,10 @@ ImageWriter::ImageWriter( cv::VideoWriter writer )
       m_Writer( writer ),
       m_IsError( false ),
       m_WriteQueue(),
-      m_QueueLock()
+      m_QueueLock(),
+      m_TraceTrack( track ),
+      m_Tracer( tracer ),
+      m_Latency( latency.get() ? latency : std::make_shared<LatencyStats>() )
 {}
 
 ImageWriter::~ImageWriter()
@@ -243,7 +398,7 @@ void ImageWriter::Start()
     }
 }
 
-bool ImageWriter::Enqueue( cv::Mat image )
+bool ImageWriter::Enqueue( cv::Mat image, const FrameInfo& info )
 {
     if( m_ImageWriteStart.Get() == false ){
         std::cerr << "Enqueue failed" << std::endl;
@@ -257,7 +412,7 @@ bool ImageWriter::Enqueue( cv::Mat image )
     }
 
     std::cerr << "Queued image file to ImageWriter" << std::endl;
-    m_WriteQueue.push( image );
+    m_WriteQueue.push( { image, info, TraceNowNs() } );
 
     return true;
 }
@@ -276,6 +431,11 @@ bool ImageWriter::IsError() const
     return m_IsError.Get();
 }
 
+LatencyStats::Summary ImageWriter::GetLatencySummary() const
+{
+    return m_Latency->GetSummary();
+}
+
 void ImageWriter::WriterThread()
 {
     try {
@@ -288,14 +448,24 @@ void ImageWriter::WriterThread()
             }
 
             if( !is_empty ){
-                cv::Mat image;
+                QueuedImage queued;
                 {
                     std::lock_guard<std::mutex> guard( m_QueueLock );
-                    image = m_WriteQueue.front();
+                    queued = m_WriteQueue.front();
                     m_WriteQueue.pop();
                 }
 
-                m_Writer << image;
+                int64_t write_begin = TraceNowNs();
+                m_Writer << queued.Image;
+                int64_t write_end = TraceNowNs();
+
+                if( m_Tracer.get() ){
+                    m_Tracer->Record( "queue", m_TraceTrack, queued.Info.Sequence, queued.EnqueueTimeNs, write_begin );
+                    m_Tracer->Record( "write", m_TraceTrack, queued.Info.Sequence, write_begin, write_end );
+                }
+                if( queued.Info.Sequence != 0 ){
+                    m_Latency->Add( write_end - queued.Info.CaptureTimeNs );
+                }
             }
 
             std::this_thread::sleep_for(std::chrono::milliseconds(1));
@@ -319,63 +489,143 @@ void ImageWriter::WriterThread()
     m_Writer.release();
 }
 
-SurveillanceCamera::SurveillanceCamera( const FaceDetector::Setting& setting )
+SurveillanceCamera::SurveillanceCamera( const FaceDetector::Setting& setting, std::shared_ptr<FrameSource> source,
+                                        const OutputSetting& output )
     :
     m_CameraState( SurveillanceCamera::INITIALIZING ),
-    // cv::VideoCapture.set() では設定できなかったので、
-    // gstreamer のパイプラインから指定
-    m_Capture( "v4l2src device=/dev/video0 ! image/jpeg,width=1280, height=720, framerate=(fraction)30/1 !jpegdec !videoconvert ! appsink max-buffers=1 drop=True", 
-               cv::CAP_GSTREAMER ),
+    m_StartupTime(),
+    m_Source( source ),
+    m_FrameSize(),
     m_RecorderConsecutiveErrorCount(0),
+    m_CaptureConsecutiveErrorCount(0),
+    m_ReconnectReturnState( SurveillanceCamera::STREAMING ),
+    m_ReconnectBeginTimeNs(0),
+    m_NextReconnectTimeNs(0),
+    m_ReconnectBackoffMs( sk_ReconnectInitialBackoffMs ),
+    m_ReconnectStats(),
     m_Detector(),
     m_DetectorSetting( setting ),
     m_DetectState( FaceDetector::IDLE ),
     m_PrevDetectState( FaceDetector::IDLE ),
     m_Faces(),
     m_NoDetectFaceTime(0),
+    m_DetectedFaces(),
+    m_DetectedFrameInfo(),
+    m_DetectedRecognitions(),
+    m_FrameSequence(0),
+    m_FrameBus(),
+    m_HttpServer(),
     m_DetectedFaceRecorder(),
-    m_WebStreamWriter()
+    m_RecordingSink(),
+    m_IsRecorderPipelineAvailable( true ),
+    m_RecordingMetadata(),
+    m_WebStreamWriter(),
+    m_Tracer( std::make_shared<FrameTracer>() ),
+    m_WebStreamLatency( std::make_shared<LatencyStats>() ),
+    m_RecorderLatency( std::make_shared<LatencyStats>() )
 {
-    if( !m_Capture.isOpened() ){
+    cv::TickMeter meter;
+
+    if( !m_Source.get() ){
+        m_Source = std::make_shared<V4L2FrameSource>();
+    }
+
+    meter.start();
+    try {
+        m_Source->Open();
+    }
+    catch( cv::Exception& e ){
+        std::cerr << e.what() << std::endl;
+    }
+    meter.stop();
+    m_StartupTime.CaptureOpen = meter.getTimeMilli();
+    std::cout << "Startup: capture open " << m_StartupTime.CaptureOpen << "[ms]" << std::endl;
+
+    if( !m_Source->IsOpened() ){
         m_CameraState = SurveillanceCamera::ERROR_OPEN_RECORDER;
         return;
     }
+    // 再接続後も同じサイズで取得できることを確認するために覚えておく
+    m_FrameSize = m_Source->GetFrameSize();
 
     try {
 
-        //m_Capture.set( cv::CAP_PROP_FRAME_WIDTH, 1920 );
-        //m_Capture.set( cv::CAP_PROP_FRAME_HEIGHT, 1080 );
-        //m_Capture.set( cv::CAP_PROP_FOURCC, cv::VideoWriter::fourcc('M', 'J', 'P', 'G') );
-        //m_Capture.set( cv::CAP_PROP_FPS, 30 );
         if( m_DetectorSetting.Width == 0 ){
             //m_DetectorSetting.Width = static_cast<int>(1920);
-            m_DetectorSetting.Width = m_Capture.get(cv::CAP_PROP_FRAME_WIDTH);
+            m_DetectorSetting.Width = m_Source->GetFrameSize().width;
         }
         if( m_DetectorSetting.Height == 0 ){
             //m_DetectorSetting.Height = static_cast<int>(1080);
-            m_DetectorSetting.Height = m_Capture.get(cv::CAP_PROP_FRAME_HEIGHT);
+            m_DetectorSetting.Height = m_Source->GetFrameSize().height;
         }
+        m_Detector.SetTracer( m_Tracer );
+
+        meter.reset();
+        meter.start();
         if( !m_Detector.Open(m_DetectorSetting) ){
             m_CameraState = SurveillanceCamera::ERROR_OPEN_RECORDER;
             return;
         }
+        meter.stop();
+        m_StartupTime.ModelLoad = meter.getTimeMilli();
+        std::cout << "Startup: model load " << m_StartupTime.ModelLoad << "[ms]" << std::endl;
+
+        meter.reset();
+        meter.start();
+        if( !m_Detector.WarmUp() ){
+            m_CameraState = SurveillanceCamera::ERROR_OPEN_RECORDER;
+            return;
+        }
+        meter.stop();
+        m_StartupTime.WarmUp = meter.getTimeMilli();
+        std::cout << "Startup: warm-up " << m_StartupTime.WarmUp << "[ms]" << std::endl;
 
 #if 1
+        meter.reset();
+        meter.start();
         auto writer = cv::VideoWriter(
             // Gstreamer output setting
-            "appsrc ! autovideoconvert ! videoscale ! video/x-raw,format=I420,width=1280,height=720,framerate=30/1 ! jpegenc ! rtpjpegpay ! udpsink host=127.0.0.1 port=50001",
+            output.WebStreamPipeline,
             cv::CAP_GSTREAMER,
             0,
-            m_Capture.get( cv::CAP_PROP_FPS ),
-            { static_cast<int>(m_Capture.get(cv::CAP_PROP_FRAME_WIDTH)), static_cast<int>(m_Capture.get(cv::CAP_PROP_FRAME_HEIGHT)) }
+            m_Source->GetFps(),
+            m_Source->GetFrameSize()
         );
         if( !writer.isOpened() ){
             m_CameraState = SurveillanceCamera::ERROR_OPEN_RECORDER;
             return;
         }
-        m_WebStreamWriter = std::make_shared<ImageWriter>( writer );
+        m_WebStreamWriter = std::make_shared<ImageWriter>( writer, TRACK_WEB_STREAM_WRITER, m_Tracer, m_WebStreamLatency );
         m_WebStreamWriter->Start();
+        meter.stop();
+        m_StartupTime.WriterOpen = meter.getTimeMilli();
+        std::cout << "Startup: writer open " << m_StartupTime.WriterOpen << "[ms]" << std::endl;
 #endif
+
+        // 共有メモリ配信はローカルの解析・保存プロセス向けのおまけ機能なので、
+        // 開けなくてもストリーミング・録画は継続する
+        if( !output.FrameBusName.empty() ){
+            auto frame_bus = std::make_shared<FrameBusPublisher>();
+            if( frame_bus->Open( output.FrameBusName,
+                                 m_Source->GetFrameSize(),
+                                 CV_8UC3 ) )
+            {
+                m_FrameBus = frame_bus;
+            }
+            else {
+                std::cerr << "Failed open frame bus. Continue without it." << std::endl;
+            }
+        }
+
+        if( output.HttpPort != 0 ){
+            auto http_server = std::make_shared<MjpegHttpServer>();
+            if( http_server->Open( { output.HttpBindAddress, output.HttpPort, MjpegHttpServer::sk_DefaultMaxClients, MjpegHttpServer::sk_DefaultJpegQuality } ) ){
+                m_HttpServer = http_server;
+            }
+            else {
+                std::cerr << "Failed open http server. Continue without it." << std::endl;
+            }
+        }
     }
     catch( cv::Exception& e ){
         std::cerr << e.what() << std::endl;
@@ -390,12 +640,21 @@ SurveillanceCamera::~SurveillanceCamera()
 {
     m_Detector.WaitDetectResult();
 
-    if( m_DetectedFaceRecorder.get() ){
-        m_DetectedFaceRecorder->End();
-    }
+    EndDetectedFaceRecorder();
     if( m_WebStreamWriter.get() ){
         m_WebStreamWriter->End();
     }
+    if( m_FrameBus.get() ){
+        m_FrameBus->Close();
+    }
+    if( m_HttpServer.get() ){
+        m_HttpServer->Close();
+    }
+}
+
+SurveillanceCamera::OutputSetting SurveillanceCamera::DefaultOutputSetting()
+{
+    return { sk_WebStreamPipeline, sk_FrameBusName, sk_HttpServerBindAddress, sk_HttpServerPort };
 }
 
 void SurveillanceCamera::Update()
@@ -412,6 +671,10 @@ void SurveillanceCamera::Update()
         DoStreamingAndRecordingFaces();
         ChangeSeqStreamingAndRecordingFaces();
         break;
+    case RECONNECTING:
+        DoReconnecting();
+        break;
+    case SOURCE_FINISHED:
     case ERROR_OPEN_RECORDER:
     case ERROR_RECORDER:
         // do nothing
@@ -426,25 +689,136 @@ SurveillanceCamera::State SurveillanceCamera::GetState()
     return m_CameraState;
 }
 
+SurveillanceCamera::StartupTime SurveillanceCamera::GetStartupTime() const
+{
+    return m_StartupTime;
+}
+
+bool SurveillanceCamera::DumpTrace( const std::string& path ) const
+{
+    std::ofstream ofs( path );
+    if( !ofs ){
+        std::cerr << "Failed open trace file: " << path << std::endl;
+        return false;
+    }
+    m_Tracer->DumpChromeTrace( ofs );
+    return static_cast<bool>(ofs);
+}
+
+LatencyStats::Summary SurveillanceCamera::GetWebStreamLatency() const
+{
+    return m_WebStreamLatency->GetSummary();
+}
+
+LatencyStats::Summary SurveillanceCamera::GetRecorderLatency() const
+{
+    return m_RecorderLatency->GetSummary();
+}
+
+LatencyStats::Summary SurveillanceCamera::GetStageLatency( const char* span ) const
+{
+    std::vector<int64_t> durations = m_Tracer->CollectDurations( span );
+    const uint64_t count = durations.size();
+    return LatencyStats::Summarize( std::move( durations ), count );
+}
+
+SurveillanceCamera::ReconnectStats SurveillanceCamera::GetReconnectStats() const
+{
+    return m_ReconnectStats;
+}
+
+void SurveillanceCamera::PrintLatencyStats() const
+{
+    auto print = []( const char* name, const LatencyStats::Summary& summary ){
+        std::cout << name << " capture-to-write latency: "
+                  << "count=" << summary.Count
+                  << " p50=" << summary.P50Ms << "[ms]"
+                  << " p90=" << summary.P90Ms << "[ms]"
+                  << " p99=" << summary.P99Ms << "[ms]"
+                  << " max=" << summary.MaxMs << "[ms]" << std::endl;
+    };
+
+    // 録画していない間も、これまでの録画分の統計を出す
+    print( "WebStreamWriter", m_WebStreamLatency->GetSummary() );
+    print( "DetectedFaceRecorder", m_RecorderLatency->GetSummary() );
+
+    std::cout << "Capture reconnect: "
+              << "count=" << m_ReconnectStats.ReconnectCount
+              << " attempts=" << m_ReconnectStats.AttemptCount
+              << " last=" << m_ReconnectStats.LastRecoveryMs << "[ms]"
+              << " max=" << m_ReconnectStats.MaxRecoveryMs << "[ms]" << std::endl;
+}
+
 void SurveillanceCamera::ChangeSeqInitializing()
 {
     // 次に進める
     m_CameraState = STREAMING;
 }
 
+cv::Mat SurveillanceCamera::CaptureFrame( FrameInfo& info, cv::Mat& native )
+{
+    cv::Mat frame;
+    bool is_read = false;
+
+    int64_t capture_begin = TraceNowNs();
+    try {
+        is_read = m_Source->Read( frame );
+    }
+    catch( cv::Exception& e ){
+        std::cerr << e.what() << std::endl;
+    }
+    int64_t capture_end = TraceNowNs();
+
+    // 入力の終端は失敗として数えない (開き直しても回復しない)
+    if( !is_read && m_Source->IsExhausted() ){
+        return cv::Mat();
+    }
+    // キャプチャの失敗は録画・配信のエラーとは分けて数え、再接続の判定に使う
+    if( !is_read || frame.empty() ){
+        ++m_CaptureConsecutiveErrorCount;
+        std::cerr << "Failed capture frame." << std::endl;
+        return cv::Mat();
+    }
+    m_CaptureConsecutiveErrorCount = 0;
+
+    // キャプチャ完了時刻をフレームの時刻とする
+    info.Sequence      = ++m_FrameSequence;
+    info.CaptureTimeNs = capture_end;
+    m_Tracer->Record( "capture", TRACK_CAPTURE, info.Sequence, capture_begin, capture_end );
+
+    native = frame;
+    if( frame.type() != CV_8UC2 ){
+        return frame;
+    }
+
+    // YUYV カメラ: 配信・録画は BGR が必要なのでここで変換する (GStreamer の videoconvert の代わり)。
+    // 検出器には native を渡し、縮小と色変換をまとめて行わせる
+    cv::Mat bgr;
+    cv::cvtColor( native, bgr, cv::COLOR_YUV2BGR_YUYV );
+    m_Tracer->Record( "convert", TRACK_CAPTURE, info.Sequence, capture_end, TraceNowNs() );
+
+    return bgr;
+}
+
 void SurveillanceCamera::DoStreaming()
 {
     FaceDetector::State state = FaceDetector::ERROR_FAIL_START;
     std::cout << "Streaming." << std::endl;
 
     try {
-        cv::Mat frame;
-        m_Capture >> frame;
+        FrameInfo info;
+        cv::Mat native;
+        cv::Mat frame = CaptureFrame( info, native );
+        if( frame.empty() ){
+            // 検出状態は前回のまま維持する
+            return;
+        }
 
     	std::cout << "size[]: " << frame.size().width << "," << frame.size().height << std::endl;
-        m_WebStreamWriter->Enqueue( frame.clone() );
+        m_WebStreamWriter->Enqueue( frame.clone(), info );
+        PublishFrame( frame, info );
 
-        state = DetectFace( frame );
+        state = DetectFace( frame, info, native );
         m_RecorderConsecutiveErrorCount = 0;
     }
     catch( cv::Exception& e ){
@@ -462,7 +836,7 @@ void SurveillanceCamera::DoStreaming()
     PrintDetectState( state );
 }
 
-FaceDetector::State SurveillanceCamera::DetectFace( cv::Mat frame )
+FaceDetector::State SurveillanceCamera::DetectFace( cv::Mat frame, const FrameInfo& info, cv::Mat native )
 {
     FaceDetector::State state = m_Detector.DetectResult();
     bool need_new_detect = false;
@@ -479,6 +853,12 @@ FaceDetector::State SurveillanceCamera::DetectFace( cv::Mat frame )
     {
         need_new_detect = true;
         m_Faces = m_Detector.GetFaceDetectVisualizedImage();
+        m_DetectedFaces = m_Detector.GetFaces();
+        m_DetectedFrameInfo = m_Detector.GetDetectedFrameInfo();
+        m_DetectedRecognitions = m_Detector.GetRecognitions();
+        if( m_RecordingMetadata.is_open() ){
+            WriteRecordingMetadata( m_DetectedFrameInfo, m_DetectedFaces, m_DetectedRecognitions );
+        }
         std::cout << "Face Detected or no face." << std::endl;
     }
     else if( state == FaceDetector::FACE_DETECTING )
@@ -499,7 +879,7 @@ FaceDetector::State SurveillanceCamera::DetectFace( cv::Mat frame )
     }
     if( need_new_detect ){
         std::cout << "Invoke Next Detect" << std::endl;
-        m_Detector.Detect( frame );
+        m_Detector.Detect( frame, info, native );
     }
 
     return state;
@@ -508,22 +888,62 @@ FaceDetector::State SurveillanceCamera::DetectFace( cv::Mat frame )
 bool SurveillanceCamera::CreateDetectedFaceRecorder()
 {
     try {
-        std::string timestamp = BuildTimeStampString() + ".mp4";
-        auto writer = cv::VideoWriter(
-            timestamp,
-            cv::VideoWriter::fourcc('m', 'p', '4', 'v'),
-            m_Capture.get(cv::CAP_PROP_FPS),
-            { static_cast<int>(m_Capture.get(cv::CAP_PROP_FRAME_WIDTH)), static_cast<int>(m_Capture.get(cv::CAP_PROP_FRAME_HEIGHT)) }
-        );
+        const std::string basename = BuildTimeStampString();
+        std::string timestamp = basename + ".mp4";
+
+        // ディスクへの書き込みは RecordingSink に任せ、エンコーダはパイプに出力する。
+        // パイプはシークできないので、mp4 はフラグメント形式で出力する。
+        cv::VideoWriter writer;
+        if( m_IsRecorderPipelineAvailable ){
+            auto sink = std::make_shared<RecordingSink>();
+            if( !sink->Open( { timestamp, RecordingSink::sk_DefaultPreallocateBytes, sk_RecordingFsyncPolicy, sk_RecordingFsyncIntervalBytes } ) ){
+                return false;
+            }
+            m_RecordingSink = sink;
+
+            writer = cv::VideoWriter(
+                sk_RecorderPipeline + std::to_string( sink->GetInputFd() ),
+                cv::CAP_GSTREAMER,
+                0,
+                m_Source->GetFps(),
+                m_Source->GetFrameSize()
+            );
+            if( !writer.isOpened() ){
+                // 以降の録画でも同じなので、一度失敗したら試さない
+                std::cerr << "Failed open recorder pipeline (gst-libav / mp4mux installed?). Fallback to cv::VideoWriter." << std::endl;
+                m_IsRecorderPipelineAvailable = false;
+                m_RecordingSink->Close();
+                m_RecordingSink.reset();
+            }
+        }
+        if( !writer.isOpened() ){
+            writer = cv::VideoWriter(
+                timestamp,
+                cv::VideoWriter::fourcc('m', 'p', '4', 'v'),
+                m_Source->GetFps(),
+                m_Source->GetFrameSize()
+            );
+        }
 
         if( !writer.isOpened() ){
+            EndDetectedFaceRecorder();
             return false;
         }
-        m_DetectedFaceRecorder = std::make_shared<ImageWriter>( writer );
+        m_DetectedFaceRecorder = std::make_shared<ImageWriter>( writer, TRACK_FACE_RECORDER, m_Tracer, m_RecorderLatency );
         m_DetectedFaceRecorder->Start();
         if( m_DetectedFaceRecorder->IsError() ){
+            EndDetectedFaceRecorder();
             return false;
         }
+
+        // 録画と同じ名前で、検出・認識結果を CSV に残す。
+        // track_id が -1 の行は顔ではなくキャプチャの欠落を表す (label: CAPTURE_LOST / CAPTURE_RECOVERED)
+        m_RecordingMetadata.open( basename + ".csv" );
+        if( m_RecordingMetadata.is_open() ){
+            m_RecordingMetadata << "frame,capture_time_ns,track_id,label,similarity,x,y,width,height,score" << std::endl;
+            // 録画を開始するきっかけになった検出結果は既に受け取っているので、ここで書き出す
+            WriteRecordingMetadata( m_DetectedFrameInfo, m_DetectedFaces, m_DetectedRecognitions );
+        }
     }
     catch( cv::Exception& e ){
         std::cerr << e.what() << std::endl;
@@ -536,8 +956,92 @@ bool SurveillanceCamera::CreateDetectedFaceRecorder()
     return true;
 }
 
+void SurveillanceCamera::PublishFrame( const cv::Mat& frame, const FrameInfo& info )
+{
+    if( m_HttpServer.get() ){
+        m_HttpServer->Publish( frame );
+    }
+    if( !m_FrameBus.get() ){
+        return;
+    }
+
+    // 検出は非同期なので、検出結果は検出元フレームの番号と時刻を付けて渡す
+    m_FrameBus->Publish( frame, info.Sequence, info.CaptureTimeNs,
+                         m_DetectedFaces, m_DetectedFrameInfo.Sequence, m_DetectedFrameInfo.CaptureTimeNs );
+}
+
+void SurveillanceCamera::EndDetectedFaceRecorder()
+{
+    if( m_DetectedFaceRecorder.get() ){
+        m_DetectedFaceRecorder->End();
+        m_DetectedFaceRecorder.reset();
+    }
+
+    if( m_RecordingMetadata.is_open() ){
+        m_RecordingMetadata.close();
+    }
+
+    // エンコーダを止めてから閉じないと、パイプに残ったデータを取りこぼす
+    if( m_RecordingSink.get() ){
+        m_RecordingSink->Close();
+
+        RecordingSink::Metrics metrics = m_RecordingSink->GetMetrics();
+        std::cout << "Recording closed: "
+                  << metrics.BytesWritten << "[bytes], "
+                  << "write avg " << metrics.WriteLatencyAvgMs << "[ms] "
+                  << "max " << metrics.WriteLatencyMaxMs << "[ms], "
+                  << "fsync " << metrics.FsyncCount << " times max " << metrics.FsyncLatencyMaxMs << "[ms], "
+                  << "max queued chunks " << metrics.MaxQueuedChunks << std::endl;
+        if( m_RecordingSink->IsError() ){
+            std::cerr << "Recording sink error happened." << std::endl;
+        }
+        m_RecordingSink.reset();
+    }
+}
+
+void SurveillanceCamera::WriteRecordingMetadata( const FrameInfo& info, const cv::Mat& faces, const std::vector<FaceRecognizer::Result>& recognitions )
+{
+    for( int i = 0; i < faces.rows; ++i ){
+        const float* face = faces.ptr<float>(i);
+        const bool has_result = i < static_cast<int>(recognitions.size());
+
+        m_RecordingMetadata << info.Sequence << ","
+                            << info.CaptureTimeNs << ","
+                            << (has_result ? recognitions[i].TrackId : 0) << ","
+                            << (has_result ? QuoteCsvField( recognitions[i].Label ) : std::string()) << ","
+                            << (has_result ? recognitions[i].Similarity : 0.0f) << ","
+                            << face[0] << "," << face[1] << "," << face[2] << "," << face[3] << ","
+                            << face[14] << "\n";
+    }
+}
+
+// キャプチャの欠落・復旧を CSV に 1 行で残す。frame は最後に取得できたフレームの番号
+void SurveillanceCamera::WriteCaptureEvent( const char* event, int64_t time_ns )
+{
+    if( !m_RecordingMetadata.is_open() ){
+        return;
+    }
+    m_RecordingMetadata << m_FrameSequence << ","
+                        << time_ns << ","
+                        << -1 << ","
+                        << event << ",,,,,,"
+                        << std::endl;
+}
+
 void SurveillanceCamera::ChangeSeqStreaming()
 {
+    if( IsSourceFinished() ){
+        FinishSource();
+        return;
+    }
+    if( IsCaptureLost() ){
+        StartReconnect();
+        if( IsError() ){
+            m_CameraState = ERROR_RECORDER;
+        }
+        return;
+    }
+
     if( m_DetectState == FaceDetector::FACE_DETECT_OK )
     {
         if( CreateDetectedFaceRecorder() ){
@@ -562,19 +1066,19 @@ void SurveillanceCamera::DoStreamingAndRecordingFaces()
     std::cout << "Streaming And Recoding." << std::endl;
 
     try {
-        cv::Mat frame;
-
-        cv::TickMeter meter;
-        std::cout << "Capture before" << std::endl;
-        meter.start();
-        m_Capture >> frame;
-        meter.stop();
-        std::cout << "Captured " << meter.getTimeMilli() << "[ms]" << std::endl;
+        FrameInfo info;
+        cv::Mat native;
+        cv::Mat frame = CaptureFrame( info, native );
+        if( frame.empty() ){
+            // 検出状態は前回のまま維持する (録画を止めない)
+            return;
+        }
 
-        m_WebStreamWriter->Enqueue( frame.clone() );
-        m_DetectedFaceRecorder->Enqueue( frame.clone() );
+        m_WebStreamWriter->Enqueue( frame.clone(), info );
+        m_DetectedFaceRecorder->Enqueue( frame.clone(), info );
+        PublishFrame( frame, info );
 
-        state = DetectFace( frame );
+        state = DetectFace( frame, info, native );
         m_RecorderConsecutiveErrorCount = 0;
     }
     catch( ... ){
@@ -595,13 +1099,24 @@ void SurveillanceCamera::DoStreamingAndRecordingFaces()
 
 void SurveillanceCamera::ChangeSeqStreamingAndRecordingFaces()
 {
+    if( IsSourceFinished() ){
+        FinishSource();
+        return;
+    }
+    if( IsCaptureLost() ){
+        StartReconnect();
+        if( IsError() ){
+            EndDetectedFaceRecorder();
+            m_CameraState = ERROR_RECORDER;
+        }
+        return;
+    }
+
     if( m_DetectState == FaceDetector::FACE_DETECT_NO_FACE )
     {
         if( m_NoDetectFaceTime >= sk_NoDetectFaceThreshold ){
             m_NoDetectFaceTime = 0;
-            if( m_DetectedFaceRecorder.get() ){
-                m_DetectedFaceRecorder->End();
-            }
+            EndDetectedFaceRecorder();
             m_CameraState = STREAMING;
         }
     }
@@ -613,16 +1128,118 @@ void SurveillanceCamera::ChangeSeqStreamingAndRecordingFaces()
     else {
         // エラー・もしくは想定しないステートなので録画終了
         m_NoDetectFaceTime = 0;
-        if( m_DetectedFaceRecorder.get() ){
-            m_DetectedFaceRecorder->End();
-        }
+        EndDetectedFaceRecorder();
         m_CameraState = STREAMING;
     }
 
     if( IsError() ){
-        if( m_DetectedFaceRecorder.get() ){
-            m_DetectedFaceRecorder->End();
+        EndDetectedFaceRecorder();
+        m_CameraState = ERROR_RECORDER;
+    }
+}
+
+bool SurveillanceCamera::IsCaptureLost() const
+{
+    return m_CaptureConsecutiveErrorCount >= sk_CaptureConsecutiveErrorThreshold;
+}
+
+bool SurveillanceCamera::IsSourceFinished() const
+{
+    return m_Source->IsExhausted();
+}
+
+void SurveillanceCamera::FinishSource()
+{
+    std::cout << "Frame source finished." << std::endl;
+
+    // 録画中なら閉じる。配信・検出はデストラクタで止める
+    EndDetectedFaceRecorder();
+    m_CameraState = SOURCE_FINISHED;
+}
+
+void SurveillanceCamera::StartReconnect()
+{
+    std::cerr << "Capture lost. Reconnecting camera." << std::endl;
+
+    // 検出器・配信・録画はそのままにして、カメラだけを開き直す
+    m_ReconnectReturnState = m_CameraState;
+    m_ReconnectBeginTimeNs = TraceNowNs();
+    m_NextReconnectTimeNs  = m_ReconnectBeginTimeNs;
+    m_ReconnectBackoffMs   = sk_ReconnectInitialBackoffMs;
+    m_Source->Release();
+
+    // 録画の途中であれば、CSV に欠落の開始を残して録画を閉じる。
+    // mp4 にはフレームの時刻が無いので、同じファイルに書き続けると欠落区間が詰まって見えなくなる。
+    // 復旧したら新しいファイルで録画を再開する
+    if( m_CameraState == STREAMING_AND_RECORDING_FACES ){
+        WriteCaptureEvent( "CAPTURE_LOST", m_ReconnectBeginTimeNs );
+        EndDetectedFaceRecorder();
+    }
+
+    m_CameraState = RECONNECTING;
+}
+
+void SurveillanceCamera::DoReconnecting()
+{
+    const int64_t now = TraceNowNs();
+    if( now < m_NextReconnectTimeNs ){
+        // Update() を塞がないよう、待つのは短い時間だけにする
+        const int64_t wait_ms = std::min<int64_t>( (m_NextReconnectTimeNs - now) / 1000000 + 1, 10 );
+        std::this_thread::sleep_for( std::chrono::milliseconds( wait_ms ) );
+        return;
+    }
+
+    ++m_ReconnectStats.AttemptCount;
+    bool is_opened = false;
+    try {
+        is_opened = m_Source->Open() && m_Source->IsOpened();
+    }
+    catch( cv::Exception& e ){
+        std::cerr << e.what() << std::endl;
+    }
+
+    // 配信・録画のライタは元のサイズで開いているので、サイズが変わった場合は失敗扱い
+    if( is_opened && m_Source->GetFrameSize() != m_FrameSize ){
+        std::cerr << "Camera reopened with different frame size." << std::endl;
+        is_opened = false;
+    }
+
+    if( !is_opened ){
+        m_Source->Release();
+        m_NextReconnectTimeNs = TraceNowNs() + static_cast<int64_t>(m_ReconnectBackoffMs) * 1000000;
+        std::cerr << "Failed reopen camera. Retry after " << m_ReconnectBackoffMs << "[ms]" << std::endl;
+        m_ReconnectBackoffMs  = std::min( m_ReconnectBackoffMs * 2, sk_ReconnectMaxBackoffMs );
+    }
+    else {
+        const int64_t recovered = TraceNowNs();
+        const double recovery_ms = (recovered - m_ReconnectBeginTimeNs) / 1e6;
+        m_Tracer->Record( "reconnect", TRACK_CAPTURE, m_FrameSequence, m_ReconnectBeginTimeNs, recovered );
+
+        ++m_ReconnectStats.ReconnectCount;
+        m_ReconnectStats.LastRecoveryMs = recovery_ms;
+        m_ReconnectStats.MaxRecoveryMs  = std::max( m_ReconnectStats.MaxRecoveryMs, recovery_ms );
+        std::cout << "Camera reconnected in " << recovery_ms << "[ms]" << std::endl;
+
+        m_CaptureConsecutiveErrorCount = 0;
+
+        // 喪失前の検出結果は新しい録画やフレームバスに持ち込まない
+        m_DetectedFaces = cv::Mat();
+        m_DetectedFrameInfo = FrameInfo();
+        m_DetectedRecognitions.clear();
+
+        m_CameraState = STREAMING;
+        if( m_ReconnectReturnState == STREAMING_AND_RECORDING_FACES ){
+            // 録画中だった場合は新しいファイルで再開し、先頭に復旧した時刻を残す
+            m_NoDetectFaceTime = 0;
+            if( CreateDetectedFaceRecorder() ){
+                WriteCaptureEvent( "CAPTURE_RECOVERED", recovered );
+                m_CameraState = STREAMING_AND_RECORDING_FACES;
+            }
         }
+    }
+
+    if( IsError() ){
+        EndDetectedFaceRecorder();
         m_CameraState = ERROR_RECORDER;
     }
 }
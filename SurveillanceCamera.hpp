@@ -2,11 +2,19 @@
 #define SURVEILLANCE_HPP_INCLUDED
 
 #include <cstdint>
+#include <fstream>
 #include <thread>
 #include <opencv2/opencv.hpp>
 #include <opencv2/objdetect.hpp>
 
 #include "Mutex.hpp"
+#include "DetectorPreprocess.hpp"
+#include "FaceRecognition.hpp"
+#include "FrameTrace.hpp"
+#include "FrameBus.hpp"
+#include "FrameSource.hpp"
+#include "MjpegHttpServer.hpp"
+#include "RecordingSink.hpp"
 
 
 
@@ -16,11 +24,18 @@ public:
     struct Setting
     {
         std::string ModelFilePath;
+        // キャプチャサイズと異なる場合は、縮小した画像で検出する
         uint32_t    Width;
         uint32_t    Height;
         float       ScoreThreshold;
         float       NMSThreshold;
         float       TopK;
+        // 起動時にウォームアップ推論を行う追加の入力サイズ
+        // Width/Height で指定したサイズは常にウォームアップされる
+        std::vector<cv::Size> WarmUpSizes;
+        // 顔認識 (SFace) のモデルと登録済み顔インデックス。空なら認識しない
+        std::string RecognitionModelPath;
+        std::string FaceIndexPath;
     };
     enum State
     {
@@ -44,10 +59,17 @@ public:
     FaceDetector& operator=( const FaceDetector& ) = delete;
 
     bool Open( const FaceDetector::Setting& setting );
-    State Detect( cv::Mat image );
+    bool WarmUp();
+    // source にはキャプチャした形式のままの画像 (YUYV なら CV_8UC2) を渡せる。
+    // 縮小して検出する場合は、image ではなく source から検出器の入力を作る
+    State Detect( cv::Mat image, const FrameInfo& info = FrameInfo(), cv::Mat source = cv::Mat() );
     State DetectResult() const;
     void WaitDetectResult();
     cv::Mat GetFaceDetectVisualizedImage() const;
+    cv::Mat GetFaces() const;
+    std::vector<FaceRecognizer::Result> GetRecognitions() const;
+    FrameInfo GetDetectedFrameInfo() const;
+    void SetTracer( std::shared_ptr<FrameTracer> tracer );
 
 private:
 
@@ -58,7 +80,15 @@ private:
     std::unique_ptr<std::thread> m_FaceDetectThread;
 
     cv::Mat m_Image;
+    cv::Mat m_SourceImage;      // キャプチャ形式のままの画像 (空なら m_Image を使う)
+    cv::Mat m_DetectInput;      // 検出器の入力サイズに縮小した画像 (使い回す)
+    DetectorPreprocessor m_Preprocessor;
     cv::Mat m_Faces;
+    FrameInfo m_FrameInfo;
+    std::shared_ptr<FrameTracer> m_Tracer;
+
+    FaceRecognizer m_Recognizer;
+    std::vector<FaceRecognizer::Result> m_Recognitions;
 
     MutexGuard<State> m_State;
 };
@@ -69,18 +99,29 @@ public:
 
     static constexpr int sk_QueueMaxSize = 5;
 
-    ImageWriter( cv::VideoWriter writer );
+    // latency を渡すと、ライタを作り直してもレイテンシ統計を引き継げる (省略時は自前で持つ)
+    ImageWriter( cv::VideoWriter writer, TraceTrack track, std::shared_ptr<FrameTracer> tracer = nullptr,
+                 std::shared_ptr<LatencyStats> latency = nullptr );
     ~ImageWriter();
     ImageWriter( const ImageWriter& ) = delete;
     ImageWriter& operator=( const ImageWriter& ) = delete;
 
     void Start();
-    bool Enqueue( cv::Mat image );
+    bool Enqueue( cv::Mat image, const FrameInfo& info = FrameInfo() );
     void End();
     bool IsError() const;
+    // キャプチャから書き込み完了までのレイテンシ
+    LatencyStats::Summary GetLatencySummary() const;
 
 private:
 
+    struct QueuedImage
+    {
+        cv::Mat   Image;
+        FrameInfo Info;
+        int64_t   EnqueueTimeNs;
+    };
+
     void WriterThread();
 
     MutexGuard<bool>                m_IsUsed;
@@ -90,8 +131,12 @@ private:
     cv::VideoWriter  m_Writer;
     MutexGuard<bool> m_IsError;
 
-    std::queue<cv::Mat> m_WriteQueue;
+    std::queue<QueuedImage> m_WriteQueue;
     std::mutex m_QueueLock;
+
+    TraceTrack                   m_TraceTrack;
+    std::shared_ptr<FrameTracer> m_Tracer;
+    std::shared_ptr<LatencyStats> m_Latency;
 };
 
 class SurveillanceCamera
@@ -103,42 +148,124 @@ public:
     // 顔判定がなくなった時に、録画停止するまでの顔判定無し判定回数
     // 設定した回数連続で顔判定無しの場合は録画停止
     static constexpr int sk_NoDetectFaceThreshold = 5;
+    // 配信用の GStreamer パイプライン
+    static constexpr const char* sk_WebStreamPipeline = "appsrc ! autovideoconvert ! videoscale ! video/x-raw,format=I420,width=1280,height=720,framerate=30/1 ! jpegenc ! rtpjpegpay ! udpsink host=127.0.0.1 port=50001";
+    // ローカルプロセス向けにフレームを配信する共有メモリ名
+    static constexpr const char* sk_FrameBusName = "/surveillance_camera_frames";
+    // MJPEG over HTTP の配信アドレスとポート。認証が無いのでループバックのみで待ち受ける
+    static constexpr const char* sk_HttpServerBindAddress = "127.0.0.1";
+    static constexpr uint16_t sk_HttpServerPort = 8080;
+    // 録画用の GStreamer パイプライン。末尾に RecordingSink のパイプの fd を付ける。
+    // avenc_mpeg4 は gst-libav、mp4mux は gst-plugins-good が必要。
+    // 開けない環境では cv::VideoWriter で直接ファイルに書く (RecordingSink は使わない)
+    static constexpr const char* sk_RecorderPipeline = "appsrc ! videoconvert ! avenc_mpeg4 ! mpeg4videoparse ! mp4mux fragment-duration=1000 streamable=true ! fdsink fd=";
+    // 録画ファイルの fsync 方針
+    static constexpr RecordingSink::FsyncPolicy sk_RecordingFsyncPolicy = RecordingSink::FSYNC_INTERVAL;
+    static constexpr uint64_t sk_RecordingFsyncIntervalBytes = 16ull * 1024 * 1024;
+    // キャプチャが連続でこの回数失敗したら、カメラだけを開き直す
+    static constexpr int sk_CaptureConsecutiveErrorThreshold = 3;
+    // 再接続の試行間隔[ms]。失敗するたびに倍にする
+    static constexpr uint32_t sk_ReconnectInitialBackoffMs = 100;
+    static constexpr uint32_t sk_ReconnectMaxBackoffMs = 5000;
+
+    // 起動処理の各フェーズにかかった時間[ms]
+    struct StartupTime
+    {
+        double CaptureOpen;
+        double ModelLoad;
+        double WarmUp;
+        double WriterOpen;
+    };
+
+    // 外部への出力先。省略時は DefaultOutputSetting() (本番の配信先)
+    // ベンチマークなどで稼働中のカメラと衝突しないよう差し替えられるようにする
+    struct OutputSetting
+    {
+        std::string WebStreamPipeline;      // appsrc から始まる GStreamer パイプライン
+        std::string FrameBusName;           // 空なら共有メモリ配信しない
+        std::string HttpBindAddress;
+        uint16_t    HttpPort;               // 0 なら HTTP 配信しない
+    };
+
+    // カメラの再接続の統計
+    struct ReconnectStats
+    {
+        uint64_t ReconnectCount;    // 復旧した回数
+        uint64_t AttemptCount;      // 開き直しを試みた回数
+        double   LastRecoveryMs;    // 最後の復旧にかかった時間 (キャプチャ喪失 -> 復旧)
+        double   MaxRecoveryMs;
+    };
 
     enum State
     {
         INITIALIZING,
         STREAMING,
         STREAMING_AND_RECORDING_FACES,
+        RECONNECTING,
+        SOURCE_FINISHED,        // 入力が終わった (ループしない動画ファイルの末尾)
         ERROR_OPEN_RECORDER,
         ERROR_RECORDER
     };
 
-    SurveillanceCamera( const FaceDetector::Setting& setting );
+    // source を省略した場合は USB カメラ (V4L2FrameSource) から取得する
+    SurveillanceCamera( const FaceDetector::Setting& setting, std::shared_ptr<FrameSource> source = nullptr,
+                        const OutputSetting& output = DefaultOutputSetting() );
     ~SurveillanceCamera();
     SurveillanceCamera( const SurveillanceCamera& ) = delete;
     SurveillanceCamera& operator=( const SurveillanceCamera& ) = delete;
 
+    static OutputSetting DefaultOutputSetting();
+
     void Update();
     State GetState();
+    StartupTime GetStartupTime() const;
+    bool DumpTrace( const std::string& path ) const;
+    void PrintLatencyStats() const;
+    LatencyStats::Summary GetWebStreamLatency() const;
+    LatencyStats::Summary GetRecorderLatency() const;
+    LatencyStats::Summary GetStageLatency( const char* span ) const;
+    ReconnectStats GetReconnectStats() const;
 
 private:
 
     void ChangeSeqInitializing();
     
+    // 配信・録画用の BGR 画像を返す。native にはカメラが出力した形式のまま返す
+    cv::Mat CaptureFrame( FrameInfo& info, cv::Mat& native );
     void DoStreaming();
-    FaceDetector::State DetectFace( cv::Mat frame );
+    FaceDetector::State DetectFace( cv::Mat frame, const FrameInfo& info, cv::Mat native );
     bool CreateDetectedFaceRecorder();
+    void EndDetectedFaceRecorder();
+    void WriteRecordingMetadata( const FrameInfo& info, const cv::Mat& faces, const std::vector<FaceRecognizer::Result>& recognitions );
+    void WriteCaptureEvent( const char* event, int64_t time_ns );
+    void PublishFrame( const cv::Mat& frame, const FrameInfo& info );
     void ChangeSeqStreaming();
 
     void DoStreamingAndRecordingFaces();
     void ChangeSeqStreamingAndRecordingFaces();
 
+    bool IsCaptureLost() const;
+    bool IsSourceFinished() const;
+    void FinishSource();
+    void StartReconnect();
+    void DoReconnecting();
+
     bool IsError() const;
 
 
     State        m_CameraState;
-    cv::VideoCapture m_Capture;
+    StartupTime  m_StartupTime;
+    std::shared_ptr<FrameSource> m_Source;
+    cv::Size m_FrameSize;
     uint32_t m_RecorderConsecutiveErrorCount;
+    uint32_t m_CaptureConsecutiveErrorCount;
+
+    // 再接続中の状態。時刻は TraceNowNs() の値
+    State    m_ReconnectReturnState;
+    int64_t  m_ReconnectBeginTimeNs;
+    int64_t  m_NextReconnectTimeNs;
+    uint32_t m_ReconnectBackoffMs;
+    ReconnectStats m_ReconnectStats;
     
     FaceDetector m_Detector;
     FaceDetector::Setting m_DetectorSetting;
@@ -146,9 +273,24 @@ private:
     FaceDetector::State m_PrevDetectState;
     uint32_t m_NoDetectFaceTime;
     cv::Mat  m_Faces;
+    cv::Mat  m_DetectedFaces;
+    FrameInfo m_DetectedFrameInfo;      // m_DetectedFaces を検出したフレーム
+    std::vector<FaceRecognizer::Result> m_DetectedRecognitions;
+
+    uint64_t m_FrameSequence;
+    std::shared_ptr<FrameBusPublisher> m_FrameBus;
+    std::shared_ptr<MjpegHttpServer>   m_HttpServer;
 
     std::shared_ptr<ImageWriter>  m_DetectedFaceRecorder;
+    std::shared_ptr<RecordingSink> m_RecordingSink;
+    bool m_IsRecorderPipelineAvailable; // sk_RecorderPipeline が開けなかったら false
+    std::ofstream m_RecordingMetadata;
     std::shared_ptr<ImageWriter>  m_WebStreamWriter;
+
+    std::shared_ptr<FrameTracer>  m_Tracer;
+    // 録画ファイルごとに ImageWriter を作り直すので、統計はカメラ側で持つ
+    std::shared_ptr<LatencyStats> m_WebStreamLatency;
+    std::shared_ptr<LatencyStats> m_RecorderLatency;
 };
 
 #endif  // SURVEILLANCE_HPP_INCLUDED
\ No newline at end of file
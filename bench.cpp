@@ -0,0 +1,557 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "DetectorPreprocess.hpp"
+#include "FrameSource.hpp"
+#include "SurveillanceCamera.hpp"
+
+// カメラ無しで SurveillanceCamera のパイプライン全体を動かすベンチマーク
+//
+// 使い方:
+//   ./surveillance_bench [--source synthetic|synthetic-yuyv|<video file>] [--frames N] [--fps F]
+//                        [--detector-size WxH] [--baseline FILE] [--update-baseline] [--tolerance R]
+//   --fps 0 でスロットル無し(最大速度)。
+//   --detector-size を指定すると縮小した画像で検出する (DetectorPreprocessor を通る)。
+//   synthetic-yuyv は YUYV カメラと同じ形式でフレームを返す。
+//   ベースラインファイルがあれば比較し、許容率を超えて悪化した項目があれば終了コード 2 を返す。
+//
+//   ./surveillance_bench --preprocess [--frames N]
+//   検出器入力の前処理 (DetectorPreprocessor) だけを計測し、スカラー版・OpenCV の
+//   cv::resize / cv::cvtColor と出力が一致するか検証する。不一致なら終了コード 3 を返す。
+//
+//   ./surveillance_bench --detector-quality --source <video file> --detector-size WxH [--frames N]
+//   縮小方法 (最近傍 / INTER_AREA / INTER_LINEAR) ごとに、キャプチャサイズのままで検出した
+//   結果と比べた検出率を出す。検出サイズを小さくする前に、顔が写った動画で確認すること。
+
+namespace {
+
+std::atomic<uint64_t> s_AllocationCount( 0 );
+
+struct BenchSetting
+{
+    std::string Source;
+    std::string ModelFilePath;
+    int         Frames;
+    double      Fps;
+    std::string BaselinePath;
+    bool        UpdateBaseline;
+    double      Tolerance;
+    bool        Preprocess;
+    cv::Size    DetectorSize;       // 0x0 = キャプチャサイズのまま
+    bool        DetectorQuality;
+};
+
+typedef std::map<std::string, double> BenchResult;
+
+void PrintUsage()
+{
+    std::cerr << "Usage: surveillance_bench [--source synthetic|synthetic-yuyv|<video file>] [--model FILE] [--frames N] [--fps F]" << std::endl
+              << "                          [--detector-size WxH] [--baseline FILE] [--update-baseline] [--tolerance R]" << std::endl
+              << "       surveillance_bench --preprocess [--frames N]" << std::endl
+              << "       surveillance_bench --detector-quality --source <video file> --detector-size WxH [--model FILE] [--frames N]" << std::endl;
+}
+
+bool ParseArgs( int argc, char** argv, BenchSetting& setting )
+{
+    for( int i = 1; i < argc; ++i ){
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+
+        if( arg == "--source" && has_value ){
+            setting.Source = argv[++i];
+        }
+        else if( arg == "--model" && has_value ){
+            setting.ModelFilePath = argv[++i];
+        }
+        else if( arg == "--frames" && has_value ){
+            setting.Frames = std::atoi( argv[++i] );
+        }
+        else if( arg == "--fps" && has_value ){
+            setting.Fps = std::atof( argv[++i] );
+        }
+        else if( arg == "--baseline" && has_value ){
+            setting.BaselinePath = argv[++i];
+        }
+        else if( arg == "--tolerance" && has_value ){
+            setting.Tolerance = std::atof( argv[++i] );
+        }
+        else if( arg == "--update-baseline" ){
+            setting.UpdateBaseline = true;
+        }
+        else if( arg == "--preprocess" ){
+            setting.Preprocess = true;
+        }
+        else if( arg == "--detector-size" && has_value ){
+            if( std::sscanf( argv[++i], "%dx%d", &setting.DetectorSize.width, &setting.DetectorSize.height ) != 2 ){
+                return false;
+            }
+        }
+        else if( arg == "--detector-quality" ){
+            setting.DetectorQuality = true;
+        }
+        else {
+            return false;
+        }
+    }
+    return setting.Frames > 0;
+}
+
+std::shared_ptr<FrameSource> CreateFrameSource( const BenchSetting& setting )
+{
+    if( setting.Source == "synthetic" ){
+        return std::make_shared<SyntheticFrameSource>( cv::Size(1280, 720), setting.Fps > 0 ? setting.Fps : 30.0 );
+    }
+    if( setting.Source == "synthetic-yuyv" ){
+        return std::make_shared<SyntheticFrameSource>( cv::Size(1280, 720), setting.Fps > 0 ? setting.Fps : 30.0, DETECTOR_INPUT_YUYV );
+    }
+    return std::make_shared<VideoFileFrameSource>( setting.Source );
+}
+
+bool LoadBaseline( const std::string& path, BenchResult& baseline )
+{
+    std::ifstream ifs( path );
+    if( !ifs ){
+        return false;
+    }
+
+    std::string line;
+    while( std::getline( ifs, line ) ){
+        std::istringstream iss( line );
+        std::string key;
+        double value;
+        if( iss >> key >> value ){
+            baseline[key] = value;
+        }
+    }
+    return true;
+}
+
+bool SaveBaseline( const std::string& path, const BenchResult& result )
+{
+    std::ofstream ofs( path );
+    for( const auto& it : result ){
+        ofs << it.first << " " << it.second << std::endl;
+    }
+    return static_cast<bool>(ofs);
+}
+
+// 1 回あたりの処理時間[ms]を返す
+template <typename Func>
+double MeasureMilli( int iterations, Func func )
+{
+    func();     // 出力バッファ確保などの初回コストを除く
+    const auto begin = std::chrono::steady_clock::now();
+    for( int i = 0; i < iterations; ++i ){
+        func();
+    }
+    const auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>( end - begin ).count() / iterations;
+}
+
+int CountMismatch( const cv::Mat& a, const cv::Mat& b )
+{
+    if( a.size() != b.size() || a.type() != b.type() ){
+        return -1;
+    }
+    return static_cast<int>(cv::norm( a, b, cv::NORM_INF ));
+}
+
+int RunPreprocessBench( int iterations )
+{
+    const cv::Size capture_size( 1280, 720 );
+    const cv::Size detector_size( 640, 360 );
+
+    cv::Mat bgr( capture_size, CV_8UC3 );
+    cv::Mat yuyv( capture_size, CV_8UC2 );
+    cv::randu( bgr, cv::Scalar::all(0), cv::Scalar::all(256) );
+    cv::randu( yuyv, cv::Scalar::all(0), cv::Scalar::all(256) );
+
+    DetectorPreprocessor preprocessor;
+    cv::Mat fused, reference, opencv, converted;
+    bool is_exact = true;
+
+    // BGR: 最近傍リサイズのみ
+    double fused_ms     = MeasureMilli( iterations, [&]{ preprocessor.Build( bgr, DETECTOR_INPUT_BGR, detector_size, fused ); } );
+    double reference_ms = MeasureMilli( iterations, [&]{ BuildDetectorInputReference( bgr, DETECTOR_INPUT_BGR, detector_size, reference ); } );
+    double opencv_ms    = MeasureMilli( iterations, [&]{ cv::resize( bgr, opencv, detector_size, 0, 0, cv::INTER_NEAREST ); } );
+    int diff_reference = CountMismatch( fused, reference );
+    int diff_opencv    = CountMismatch( fused, opencv );
+    is_exact = is_exact && (diff_reference == 0) && (diff_opencv == 0);
+    std::cout << "BGR  -> BGR " << detector_size.width << "x" << detector_size.height << ": "
+              << "fused " << fused_ms << "[ms], scalar " << reference_ms << "[ms], cv::resize " << opencv_ms << "[ms], "
+              << "max diff (scalar) " << diff_reference << ", max diff (opencv) " << diff_opencv << std::endl;
+
+    // YUYV: 色変換 + 最近傍リサイズ。OpenCV では全画素を変換してから縮小することになる
+    fused_ms     = MeasureMilli( iterations, [&]{ preprocessor.Build( yuyv, DETECTOR_INPUT_YUYV, detector_size, fused ); } );
+    reference_ms = MeasureMilli( iterations, [&]{ BuildDetectorInputReference( yuyv, DETECTOR_INPUT_YUYV, detector_size, reference ); } );
+    opencv_ms    = MeasureMilli( iterations, [&]{
+        cv::cvtColor( yuyv, converted, cv::COLOR_YUV2BGR_YUYV );
+        cv::resize( converted, opencv, detector_size, 0, 0, cv::INTER_NEAREST );
+    } );
+    diff_reference = CountMismatch( fused, reference );
+    diff_opencv    = CountMismatch( fused, opencv );
+    is_exact = is_exact && (diff_reference == 0) && (diff_opencv == 0);
+    std::cout << "YUYV -> BGR " << detector_size.width << "x" << detector_size.height << ": "
+              << "fused " << fused_ms << "[ms], scalar " << reference_ms << "[ms], cv::cvtColor+resize " << opencv_ms << "[ms], "
+              << "max diff (scalar) " << diff_reference << ", max diff (opencv) " << diff_opencv << std::endl;
+
+    if( !is_exact ){
+        std::cout << "MISMATCH: fused preprocessing differs from the reference path." << std::endl;
+        return 3;
+    }
+    return 0;
+}
+
+float FaceIoU( const float* a, const float* b )
+{
+    const float x1 = std::max( a[0], b[0] );
+    const float y1 = std::max( a[1], b[1] );
+    const float x2 = std::min( a[0] + a[2], b[0] + b[2] );
+    const float y2 = std::min( a[1] + a[3], b[1] + b[3] );
+    if( x2 <= x1 || y2 <= y1 ){
+        return 0.0f;
+    }
+    const float intersection = (x2 - x1) * (y2 - y1);
+    return intersection / (a[2] * a[3] + b[2] * b[3] - intersection);
+}
+
+// 縮小方法ごとの検出品質を、キャプチャサイズで検出した結果を正解として比べる
+int RunDetectorQualityBench( const BenchSetting& setting )
+{
+    constexpr float sk_MatchIoU = 0.5f;
+
+    if( setting.DetectorSize.area() <= 0 ){
+        std::cerr << "--detector-quality needs --detector-size." << std::endl;
+        return 1;
+    }
+
+    VideoFileFrameSource source( setting.Source, false );
+    if( !source.Open() ){
+        std::cerr << "Failed open source: " << setting.Source << std::endl;
+        return 1;
+    }
+
+    const cv::Size capture_size = source.GetFrameSize();
+    cv::Ptr<cv::FaceDetectorYN> reference_detector = cv::FaceDetectorYN::create( setting.ModelFilePath, "", capture_size, 0.95f, 0.3f, 5000 );
+    cv::Ptr<cv::FaceDetectorYN> small_detector     = cv::FaceDetectorYN::create( setting.ModelFilePath, "", setting.DetectorSize, 0.95f, 0.3f, 5000 );
+
+    struct Method
+    {
+        const char* Name;
+        std::function<void( const cv::Mat&, cv::Mat& )> Resize;
+        uint64_t Matched;
+        uint64_t Extra;
+        double   IoUSum;
+    };
+    DetectorPreprocessor preprocessor;
+    std::vector<Method> methods = {
+        { "nearest (DetectorPreprocessor)", [&]( const cv::Mat& src, cv::Mat& dst ){ preprocessor.Build( src, DETECTOR_INPUT_BGR, setting.DetectorSize, dst ); }, 0, 0, 0.0 },
+        { "INTER_AREA",                   [&]( const cv::Mat& src, cv::Mat& dst ){ cv::resize( src, dst, setting.DetectorSize, 0, 0, cv::INTER_AREA ); }, 0, 0, 0.0 },
+        { "INTER_LINEAR",                 [&]( const cv::Mat& src, cv::Mat& dst ){ cv::resize( src, dst, setting.DetectorSize, 0, 0, cv::INTER_LINEAR ); }, 0, 0, 0.0 }
+    };
+
+    const float scale_x = static_cast<float>(capture_size.width) / setting.DetectorSize.width;
+    const float scale_y = static_cast<float>(capture_size.height) / setting.DetectorSize.height;
+
+    uint64_t reference_count = 0;
+    int frames = 0;
+    cv::Mat frame, reference, input, faces;
+    for( ; frames < setting.Frames && source.Read( frame ); ++frames ){
+        reference_detector->detect( frame, reference );
+        reference_count += reference.rows;
+
+        for( Method& method : methods ){
+            method.Resize( frame, input );
+            small_detector->detect( input, faces );
+
+            // 検出結果を貪欲に正解と対応付ける
+            std::vector<bool> is_used( reference.rows, false );
+            for( int i = 0; i < faces.rows; ++i ){
+                float box[4] = { faces.at<float>(i, 0) * scale_x, faces.at<float>(i, 1) * scale_y,
+                                 faces.at<float>(i, 2) * scale_x, faces.at<float>(i, 3) * scale_y };
+                int best = -1;
+                float best_iou = sk_MatchIoU;
+                for( int j = 0; j < reference.rows; ++j ){
+                    const float iou = is_used[j] ? 0.0f : FaceIoU( box, reference.ptr<float>(j) );
+                    if( iou >= best_iou ){
+                        best = j;
+                        best_iou = iou;
+                    }
+                }
+                if( best < 0 ){
+                    ++method.Extra;
+                    continue;
+                }
+                is_used[best] = true;
+                ++method.Matched;
+                method.IoUSum += best_iou;
+            }
+        }
+    }
+
+    std::cout << "==== Detector quality " << setting.DetectorSize.width << "x" << setting.DetectorSize.height
+              << " vs " << capture_size.width << "x" << capture_size.height
+              << " (" << frames << " frames, " << reference_count << " reference faces) ====" << std::endl;
+    for( const Method& method : methods ){
+        std::cout << method.Name << ": "
+                  << "recall " << (reference_count > 0 ? 100.0 * method.Matched / reference_count : 0.0) << "[%], "
+                  << "mean IoU " << (method.Matched > 0 ? method.IoUSum / method.Matched : 0.0) << ", "
+                  << "extra " << method.Extra << std::endl;
+    }
+    return 0;
+}
+
+// 悪化した項目の数を返す
+int CompareBaseline( const BenchResult& baseline, const BenchResult& result, double tolerance )
+{
+    int regressions = 0;
+
+    for( const auto& it : result ){
+        auto base = baseline.find( it.first );
+        if( base == baseline.end() || base->second <= 0.0 ){
+            continue;
+        }
+
+        // fps のみ大きいほど良い。それ以外 (時間・アロケーション回数) は小さいほど良い
+        const bool higher_is_better = (it.first == "fps");
+        const double ratio = it.second / base->second;
+        const bool is_regression = higher_is_better ? (ratio < 1.0 - tolerance) : (ratio > 1.0 + tolerance);
+
+        std::cout << (is_regression ? "REGRESSION " : "           ")
+                  << it.first << ": " << base->second << " -> " << it.second << std::endl;
+        if( is_regression ){
+            ++regressions;
+        }
+    }
+
+    return regressions;
+}
+
+}
+
+// パイプライン全体(ワーカースレッド含む)のヒープ確保回数を数える
+//
+// 数えるのは operator new と、cv::Mat のバッファ確保 (CountingMatAllocator) の 2 つ。
+// cv::Mat のバッファは cv::fastMalloc で確保され operator new を通らないので、
+// 既定のアロケータを差し替えて数える。OpenCV 内部の作業バッファ (cv::AutoBuffer など) や
+// GStreamer が直接 malloc する分は数えない。
+namespace {
+
+class CountingMatAllocator : public cv::MatAllocator
+{
+public:
+
+    cv::UMatData* allocate( int dims, const int* sizes, int type, void* data, size_t* step,
+                            cv::AccessFlag flags, cv::UMatUsageFlags usage_flags ) const override
+    {
+        // data が渡された場合は外部のバッファを包むだけなので確保しない
+        if( data == nullptr ){
+            s_AllocationCount.fetch_add( 1, std::memory_order_relaxed );
+        }
+        return cv::Mat::getStdAllocator()->allocate( dims, sizes, type, data, step, flags, usage_flags );
+    }
+
+    bool allocate( cv::UMatData* data, cv::AccessFlag flags, cv::UMatUsageFlags usage_flags ) const override
+    {
+        return cv::Mat::getStdAllocator()->allocate( data, flags, usage_flags );
+    }
+
+    void deallocate( cv::UMatData* data ) const override
+    {
+        cv::Mat::getStdAllocator()->deallocate( data );
+    }
+};
+
+}
+
+void* operator new( size_t size )
+{
+    s_AllocationCount.fetch_add( 1, std::memory_order_relaxed );
+    void* p = std::malloc( size == 0 ? 1 : size );
+    if( p == nullptr ){
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[]( size_t size )
+{
+    return operator new( size );
+}
+
+void* operator new( size_t size, const std::nothrow_t& ) noexcept
+{
+    s_AllocationCount.fetch_add( 1, std::memory_order_relaxed );
+    return std::malloc( size == 0 ? 1 : size );
+}
+
+void* operator new[]( size_t size, const std::nothrow_t& tag ) noexcept
+{
+    return operator new( size, tag );
+}
+
+void operator delete( void* p ) noexcept
+{
+    std::free( p );
+}
+
+void operator delete[]( void* p ) noexcept
+{
+    std::free( p );
+}
+
+void operator delete( void* p, const std::nothrow_t& ) noexcept
+{
+    std::free( p );
+}
+
+void operator delete[]( void* p, const std::nothrow_t& ) noexcept
+{
+    std::free( p );
+}
+
+int main( int argc, char** argv )
+{
+    static CountingMatAllocator s_MatAllocator;
+    cv::Mat::setDefaultAllocator( &s_MatAllocator );
+
+    BenchSetting bench = {
+        "synthetic",
+        "model/face_detection_yunet_2022mar_int8.onnx",
+        300,
+        0.0,
+        "bench_baseline.txt",
+        false,
+        0.10,
+        false,
+        cv::Size(),
+        false
+    };
+    if( !ParseArgs( argc, argv, bench ) ){
+        PrintUsage();
+        return 1;
+    }
+
+    if( bench.Preprocess ){
+        return RunPreprocessBench( bench.Frames );
+    }
+    if( bench.DetectorQuality ){
+        return RunDetectorQualityBench( bench );
+    }
+
+    FaceDetector::Setting setting = {
+        bench.ModelFilePath,
+        static_cast<uint32_t>(bench.DetectorSize.width),
+        static_cast<uint32_t>(bench.DetectorSize.height),
+        0.95f,
+        0.3f,
+        5000,
+        {},
+        "",
+        ""
+    };
+
+    // 稼働中のカメラの配信先 (UDP・共有メモリ・HTTP ポート) には触れない。
+    // 配信のエンコードは計測に含めたいので、出力だけ捨てる
+    SurveillanceCamera::OutputSetting output = {
+        "appsrc ! autovideoconvert ! videoscale ! video/x-raw,format=I420,width=1280,height=720,framerate=30/1 ! jpegenc ! fakesink",
+        "/surveillance_bench_frames_" + std::to_string( getpid() ),
+        "",
+        0
+    };
+
+    auto camera = std::make_shared<SurveillanceCamera>( setting, CreateFrameSource( bench ), output );
+    if( camera->GetState() == SurveillanceCamera::ERROR_OPEN_RECORDER ){
+        std::cerr << "Failed open recorder." << std::endl;
+        return 1;
+    }
+    // INITIALIZING -> STREAMING
+    camera->Update();
+
+    const auto interval = std::chrono::nanoseconds(
+        bench.Fps > 0 ? static_cast<int64_t>(1e9 / bench.Fps) : 0 );
+    auto next_frame = std::chrono::steady_clock::now();
+
+    const uint64_t allocation_begin = s_AllocationCount.load();
+    const auto time_begin = std::chrono::steady_clock::now();
+    int frames = 0;
+    for( ; frames < bench.Frames; ++frames ){
+        if( camera->GetState() == SurveillanceCamera::ERROR_RECORDER ){
+            std::cerr << "Recording error happened." << std::endl;
+            break;
+        }
+        if( camera->GetState() == SurveillanceCamera::SOURCE_FINISHED ){
+            break;
+        }
+        camera->Update();
+
+        if( bench.Fps > 0 ){
+            next_frame += interval;
+            std::this_thread::sleep_until( next_frame );
+        }
+    }
+    const auto time_end = std::chrono::steady_clock::now();
+    const uint64_t allocation_end = s_AllocationCount.load();
+
+    const double elapsed = std::chrono::duration<double>( time_end - time_begin ).count();
+    const LatencyStats::Summary capture = camera->GetStageLatency( "capture" );
+    const LatencyStats::Summary convert = camera->GetStageLatency( "convert" );
+    const LatencyStats::Summary detect  = camera->GetStageLatency( "detect" );
+    const LatencyStats::Summary queue   = camera->GetStageLatency( "queue" );
+    const LatencyStats::Summary write   = camera->GetStageLatency( "write" );
+    const LatencyStats::Summary e2e     = camera->GetWebStreamLatency();
+
+    BenchResult result;
+    result["fps"]                    = frames / elapsed;
+    result["heap_allocations_per_frame"] = static_cast<double>(allocation_end - allocation_begin) / std::max( frames, 1 );
+    result["capture_p50_ms"]         = capture.P50Ms;
+    result["convert_p50_ms"]         = convert.P50Ms;
+    result["detect_p50_ms"]          = detect.P50Ms;
+    result["detect_p99_ms"]          = detect.P99Ms;
+    result["queue_p50_ms"]           = queue.P50Ms;
+    result["write_p50_ms"]           = write.P50Ms;
+    result["e2e_p50_ms"]             = e2e.P50Ms;
+    result["e2e_p99_ms"]             = e2e.P99Ms;
+
+    std::cout << "==== Benchmark result (" << frames << " frames, " << elapsed << "[s]) ====" << std::endl;
+    for( const auto& it : result ){
+        std::cout << it.first << " " << it.second << std::endl;
+    }
+    camera->DumpTrace( "bench_trace.json" );
+
+    // デストラクタでワーカースレッドを止めてから比較結果を返す
+    camera.reset();
+
+    if( bench.UpdateBaseline ){
+        if( !SaveBaseline( bench.BaselinePath, result ) ){
+            std::cerr << "Failed save baseline: " << bench.BaselinePath << std::endl;
+            return 1;
+        }
+        std::cout << "Baseline updated: " << bench.BaselinePath << std::endl;
+        return 0;
+    }
+
+    BenchResult baseline;
+    if( !LoadBaseline( bench.BaselinePath, baseline ) ){
+        std::cout << "No baseline found. Run with --update-baseline to store one." << std::endl;
+        return 0;
+    }
+
+    std::cout << "==== Compare with baseline (tolerance " << bench.Tolerance * 100 << "%) ====" << std::endl;
+    return CompareBaseline( baseline, result, bench.Tolerance ) > 0 ? 2 : 0;
+}
@@ -0,0 +1,106 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/objdetect.hpp>
+
+#include "FaceRecognition.hpp"
+
+// 顔認識用のインデックス (FaceIndex) を作るツール
+//
+// 使い方:
+//   ./surveillance_enroll <detector model> <recognition model> <output index> <name>=<image> ...
+//   各画像で最もスコアの高い顔の特徴量を、name のラベルで登録する。
+
+namespace {
+
+constexpr float sk_ScoreThreshold = 0.9f;
+constexpr float sk_NMSThreshold   = 0.3f;
+constexpr int   sk_TopK           = 5000;
+
+// 検出結果のうちスコアが最大の行を返す。顔が無ければ -1
+int FindBestFace( const cv::Mat& faces )
+{
+    int best = -1;
+    for( int i = 0; i < faces.rows; ++i ){
+        if( best < 0 || faces.at<float>(i, 14) > faces.at<float>(best, 14) ){
+            best = i;
+        }
+    }
+    return best;
+}
+
+}
+
+int main( int argc, char** argv )
+{
+    if( argc < 5 ){
+        std::cerr << "Usage: surveillance_enroll <detector model> <recognition model> <output index> <name>=<image> ..." << std::endl;
+        return 1;
+    }
+
+    const std::string detector_model    = argv[1];
+    const std::string recognition_model = argv[2];
+    const std::string index_path        = argv[3];
+
+    FaceRecognizer recognizer;
+    if( !recognizer.Open( { recognition_model, "" } ) ){
+        std::cerr << "Failed open recognition model. " << recognition_model << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> names;
+    std::vector<cv::Mat> features;
+
+    try {
+        cv::Ptr<cv::FaceDetectorYN> detector = cv::FaceDetectorYN::create( detector_model, "", cv::Size( 320, 320 ), sk_ScoreThreshold, sk_NMSThreshold, sk_TopK );
+
+        for( int i = 4; i < argc; ++i ){
+            const std::string arg = argv[i];
+            const size_t separator = arg.find( '=' );
+            if( separator == std::string::npos || separator == 0 ){
+                std::cerr << "Invalid argument. " << arg << std::endl;
+                return 1;
+            }
+            const std::string name = arg.substr( 0, separator );
+            const std::string path = arg.substr( separator + 1 );
+            if( name.size() >= FaceIndex::sk_NameLength ){
+                std::cerr << "Name is too long. " << name << std::endl;
+                return 1;
+            }
+
+            cv::Mat image = cv::imread( path );
+            if( image.empty() ){
+                std::cerr << "Failed read image. " << path << std::endl;
+                return 1;
+            }
+
+            cv::Mat faces;
+            detector->setInputSize( image.size() );
+            detector->detect( image, faces );
+
+            const int best = FindBestFace( faces );
+            if( best < 0 ){
+                std::cerr << "No face found. " << path << std::endl;
+                return 1;
+            }
+
+            names.push_back( name );
+            features.push_back( recognizer.ExtractFeature( image, faces.row( best ) ) );
+            std::cout << "Enrolled " << name << " (" << path << ")" << std::endl;
+        }
+    }
+    catch( cv::Exception& e ){
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    if( !FaceIndex::Write( index_path, names, features ) ){
+        std::cerr << "Failed write index. " << index_path << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << names.size() << " faces to " << index_path << std::endl;
+
+    return 0;
+}
@@ -1,3 +1,4 @@
+#include <csignal>
 #include <iostream>
 #include <thread>
 
@@ -8,19 +9,36 @@
 
 #include "SurveillanceCamera.hpp"
 
+namespace {
+
+volatile std::sig_atomic_t s_TraceDumpRequested = 0;
+
+// kill -USR1 <pid> でトレースとレイテンシ統計を出力する
+void RequestTraceDump( int )
+{
+    s_TraceDumpRequested = 1;
+}
+
+}
+
 int main( int argc, char** argv ) 
 {
 
     constexpr float score_threshold = 0.95;
     constexpr float nms_threshold = 0.3;
     constexpr float topK = 5000;
+    // 検出サイズを小さくすると検出が速くなるが、縮小は最近傍なので小さい顔を取りこぼしやすい。
+    // 変更する前に surveillance_bench --detector-quality で検出率を確認すること
     FaceDetector::Setting setting = {
         "model/face_detection_yunet_2022mar_int8.onnx",    // Model filepath
         0,                                                 // Image Width(Zero=SameCameraCaptureSize)
         0,                                                 // Image Height(Zero=SameCameraCaptureSize)
         score_threshold,
         nms_threshold,
-        topK
+        topK,
+        {},                                                // Additional warm-up sizes
+        "",                                                // Recognition model (e.g. model/face_recognition_sface_2021dec.onnx, Empty=Disabled)
+        ""                                                 // Enrolled face index (made by surveillance_enroll)
     };
 
     //cv::setNumThreads(0);
@@ -30,13 +48,25 @@ int main( int argc, char** argv )
         std::cerr << "Failed open recorder." << std::endl;
         return 1;
     }
+    std::cout << "Surveillance camera ready." << std::endl;
+
+    std::signal( SIGUSR1, RequestTraceDump );
 
     while(1){
         if( camera->GetState() == SurveillanceCamera::ERROR_RECORDER ){
             std::cerr << "Recording error happened." << std::endl;
             break;
         }
+        if( camera->GetState() == SurveillanceCamera::SOURCE_FINISHED ){
+            break;
+        }
         camera->Update();
+
+        if( s_TraceDumpRequested ){
+            s_TraceDumpRequested = 0;
+            camera->DumpTrace( "trace.json" );
+            camera->PrintLatencyStats();
+        }
         
         //std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
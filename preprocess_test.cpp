@@ -0,0 +1,139 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "DetectorPreprocess.hpp"
+
+// DetectorPreprocessor の SIMD 版がスカラー版・OpenCV とビット単位で一致するか確かめる
+//
+// 使い方: make test
+//   不一致があれば終了コード 1 を返す。
+//   ビルドしたアーキテクチャの SIMD 版 (SSE4.1 / NEON) しか検証しないので、
+//   NEON 版は ARM 上で実行すること。
+
+namespace {
+
+struct TestCase
+{
+    cv::Size Capture;
+    cv::Size Detector;
+};
+
+// 0 なら一致
+int MaxDiff( const cv::Mat& a, const cv::Mat& b )
+{
+    if( a.size() != b.size() || a.type() != b.type() ){
+        return 256;
+    }
+    return static_cast<int>(cv::norm( a, b, cv::NORM_INF ));
+}
+
+bool Check( const std::string& name, const cv::Mat& actual, const cv::Mat& expected )
+{
+    const int diff = MaxDiff( actual, expected );
+    if( diff != 0 ){
+        std::cout << "MISMATCH " << name << ": max diff " << diff << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::string Describe( const char* format, const TestCase& test, const char* suffix )
+{
+    return std::string( format ) + " "
+        + std::to_string( test.Capture.width ) + "x" + std::to_string( test.Capture.height ) + " -> "
+        + std::to_string( test.Detector.width ) + "x" + std::to_string( test.Detector.height ) + suffix;
+}
+
+bool RunCase( DetectorPreprocessor& preprocessor, const TestCase& test, const char* suffix, const cv::Mat& bgr, const cv::Mat& yuyv )
+{
+    bool is_exact = true;
+    cv::Mat simd, reference, opencv, converted;
+
+    preprocessor.Build( bgr, DETECTOR_INPUT_BGR, test.Detector, simd );
+    BuildDetectorInputReference( bgr, DETECTOR_INPUT_BGR, test.Detector, reference );
+    cv::resize( bgr, opencv, test.Detector, 0, 0, cv::INTER_NEAREST );
+    is_exact = Check( Describe( "BGR ", test, suffix ) + " (scalar)", simd, reference ) && is_exact;
+    is_exact = Check( Describe( "BGR ", test, suffix ) + " (opencv)", simd, opencv ) && is_exact;
+
+    preprocessor.Build( yuyv, DETECTOR_INPUT_YUYV, test.Detector, simd );
+    BuildDetectorInputReference( yuyv, DETECTOR_INPUT_YUYV, test.Detector, reference );
+    cv::cvtColor( yuyv, converted, cv::COLOR_YUV2BGR_YUYV );
+    cv::resize( converted, opencv, test.Detector, 0, 0, cv::INTER_NEAREST );
+    is_exact = Check( Describe( "YUYV", test, suffix ) + " (scalar)", simd, reference ) && is_exact;
+    is_exact = Check( Describe( "YUYV", test, suffix ) + " (opencv)", simd, opencv ) && is_exact;
+
+    return is_exact;
+}
+
+}
+
+int main()
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    std::cout << "SIMD: NEON" << std::endl;
+#elif defined(__SSE4_1__)
+    std::cout << "SIMD: SSE4.1" << std::endl;
+#else
+    std::cout << "SIMD: none (scalar only)" << std::endl;
+#endif
+
+    // 出力幅が 8 の倍数でないもの (端数処理)、拡大、同じサイズも含める
+    const std::vector<TestCase> tests = {
+        { cv::Size( 1280, 720 ), cv::Size( 640, 360 ) },
+        { cv::Size( 1280, 720 ), cv::Size( 333, 187 ) },
+        { cv::Size( 640, 480 ),  cv::Size( 320, 240 ) },
+        { cv::Size( 640, 480 ),  cv::Size( 640, 480 ) },
+        { cv::Size( 322, 242 ),  cv::Size( 644, 485 ) },
+        { cv::Size( 2, 1 ),      cv::Size( 7, 3 ) }
+    };
+
+    // 同じインスタンスを使い回し、サイズが変わったときの作り直しも確かめる
+    DetectorPreprocessor preprocessor;
+    cv::RNG rng( 0x5eed );
+    bool is_exact = true;
+    int cases = 0;
+
+    for( const TestCase& test : tests ){
+        cv::Mat bgr( test.Capture, CV_8UC3 );
+        cv::Mat yuyv( test.Capture, CV_8UC2 );
+        rng.fill( bgr, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256) );
+        rng.fill( yuyv, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256) );
+        is_exact = RunCase( preprocessor, test, "", bgr, yuyv ) && is_exact;
+        ++cases;
+
+        // 行が連続していない (ROI) 入力
+        cv::Mat bgr_parent( test.Capture.height + 2, test.Capture.width + 4, CV_8UC3 );
+        cv::Mat yuyv_parent( test.Capture.height + 2, test.Capture.width + 4, CV_8UC2 );
+        rng.fill( bgr_parent, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256) );
+        rng.fill( yuyv_parent, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256) );
+        const cv::Rect roi( 2, 1, test.Capture.width, test.Capture.height );
+        is_exact = RunCase( preprocessor, test, " (roi)", bgr_parent( roi ), yuyv_parent( roi ) ) && is_exact;
+        ++cases;
+    }
+
+    // Y / U / V の端の値 (飽和の確認)
+    {
+        const TestCase test = { cv::Size( 256, 4 ), cv::Size( 256, 4 ) };
+        cv::Mat bgr( test.Capture, CV_8UC3, cv::Scalar::all(0) );
+        cv::Mat yuyv( test.Capture, CV_8UC2 );
+        for( int y = 0; y < yuyv.rows; ++y ){
+            uint8_t* row = yuyv.ptr<uint8_t>( y );
+            for( int x = 0; x < yuyv.cols; ++x ){
+                row[x * 2]     = static_cast<uint8_t>( x );
+                row[x * 2 + 1] = static_cast<uint8_t>( (x & 1) ? (y & 1 ? 255 : 0) : (y & 2 ? 255 : 0) );
+            }
+        }
+        is_exact = RunCase( preprocessor, test, " (extremes)", bgr, yuyv ) && is_exact;
+        ++cases;
+    }
+
+    if( !is_exact ){
+        std::cout << "FAILED" << std::endl;
+        return 1;
+    }
+    std::cout << "OK: " << cases << " cases bit-exact." << std::endl;
+    return 0;
+}